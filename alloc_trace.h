@@ -0,0 +1,304 @@
+#ifndef ALLOC_TRACE_H
+#define ALLOC_TRACE_H
+
+// Heap tracking for diagnostic builds, `make clean && make ALLOC_TRACE=1`.
+// This defines malloc and friends for the whole program, so only the file
+// with main() includes it. Every allocation, operator new included, is
+// charged to the innermost running Tool_Phase and to its call stack; peak
+// heap, counts per phase and the busiest call sites go to stderr at exit.
+#ifdef ALLOC_TRACE
+
+#include <atomic>
+#include <algorithm>
+#include <cxxabi.h>
+#include <execinfo.h>
+#include <malloc.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+#include "tool_stats.h"
+
+#ifndef __GLIBC__
+#error "ALLOC_TRACE builds interpose glibc's allocator"
+#endif
+
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t count, size_t size);
+extern "C" void* __libc_realloc(void* ptr, size_t size);
+extern "C" void* __libc_memalign(size_t align, size_t size);
+extern "C" void __libc_free(void* ptr);
+
+#define ALLOC_TRACE_DEPTH (10)
+#define ALLOC_TRACE_SITES (0x4000) // power of two
+#define ALLOC_TRACE_PHASES (64)
+#define ALLOC_TRACE_TOP (12)
+
+typedef struct
+{
+   void* frames[ALLOC_TRACE_DEPTH];
+   int num_frames;
+   uint64_t count;
+   uint64_t bytes;
+} Alloc_Site;
+
+typedef struct
+{
+   uint64_t count;
+   uint64_t bytes;
+} Alloc_Totals;
+
+// Fixed tables, the hooks can't allocate. Phase 0 is time outside any phase.
+static std::atomic_flag alloc_trace_lock = ATOMIC_FLAG_INIT;
+static thread_local bool alloc_trace_busy = false;
+static size_t alloc_trace_heap = 0;
+static size_t alloc_trace_peak = 0;
+static Alloc_Totals alloc_trace_total = {};
+static Alloc_Totals alloc_trace_phases[ALLOC_TRACE_PHASES + 1] = {};
+static Alloc_Site alloc_trace_sites[ALLOC_TRACE_SITES] = {};
+static uint64_t alloc_trace_unsited = 0;
+
+static void alloc_trace_acquire()
+{
+   while (alloc_trace_lock.test_and_set(std::memory_order_acquire));
+}
+
+static void alloc_trace_release_lock()
+{
+   alloc_trace_lock.clear(std::memory_order_release);
+}
+
+static void alloc_trace_free(void* ptr)
+{
+   if (!ptr) return;
+
+   size_t size = malloc_usable_size(ptr);
+   alloc_trace_acquire();
+   alloc_trace_heap -= size;
+   alloc_trace_release_lock();
+}
+
+static Alloc_Site* alloc_trace_find_site(void** frames, int num_frames)
+{
+   uint64_t hash = 14695981039346656037ULL;
+   for (int i = 0; i < num_frames; i++)
+      hash = (hash ^ (uintptr_t)frames[i]) * 1099511628211ULL;
+
+   for (size_t probe = 0; probe < ALLOC_TRACE_SITES; probe++)
+   {
+      Alloc_Site* site = &alloc_trace_sites[(hash + probe) & (ALLOC_TRACE_SITES - 1)];
+      if (!site->count)
+      {
+         memcpy(site->frames, frames, num_frames * sizeof(void*));
+         site->num_frames = num_frames;
+         return site;
+      }
+      if (site->num_frames == num_frames && !memcmp(site->frames, frames, num_frames * sizeof(void*)))
+         return site;
+   }
+   return NULL;
+}
+
+// Kept out of line so the two frames to drop are always this and the hook
+__attribute__((noinline)) static void alloc_trace_record(void* ptr)
+{
+   if (!ptr) return;
+
+   // backtrace() allocates the first time it runs, those only count towards the heap
+   void* frames[ALLOC_TRACE_DEPTH + 2];
+   int num_frames = 0;
+   bool sited = !alloc_trace_busy;
+   if (sited)
+   {
+      alloc_trace_busy = true;
+      num_frames = backtrace(frames, ALLOC_TRACE_DEPTH + 2) - 2;
+      alloc_trace_busy = false;
+   }
+
+   size_t size = malloc_usable_size(ptr);
+   int phase = std::min(tool_stats_current_phase(), ALLOC_TRACE_PHASES);
+   alloc_trace_acquire();
+   alloc_trace_heap += size;
+   alloc_trace_peak = std::max(alloc_trace_peak, alloc_trace_heap);
+   alloc_trace_total.count++;
+   alloc_trace_total.bytes += size;
+   alloc_trace_phases[phase].count++;
+   alloc_trace_phases[phase].bytes += size;
+
+   Alloc_Site* site = sited && num_frames > 0 ? alloc_trace_find_site(frames + 2, num_frames) : NULL;
+   if (site)
+   {
+      site->count++;
+      site->bytes += size;
+   }
+   else
+      alloc_trace_unsited++;
+   alloc_trace_release_lock();
+}
+
+extern "C" void* malloc(size_t size)
+{
+   void* ptr = __libc_malloc(size);
+   alloc_trace_record(ptr);
+   return ptr;
+}
+
+extern "C" void* calloc(size_t count, size_t size)
+{
+   void* ptr = __libc_calloc(count, size);
+   alloc_trace_record(ptr);
+   return ptr;
+}
+
+extern "C" void* realloc(void* ptr, size_t size)
+{
+   size_t old_size = ptr ? malloc_usable_size(ptr) : 0;
+   void* new_ptr = __libc_realloc(ptr, size);
+   if (new_ptr || !size)
+   {
+      alloc_trace_acquire();
+      alloc_trace_heap -= old_size;
+      alloc_trace_release_lock();
+   }
+   alloc_trace_record(new_ptr);
+   return new_ptr;
+}
+
+extern "C" void free(void* ptr)
+{
+   alloc_trace_free(ptr);
+   __libc_free(ptr);
+}
+
+extern "C" void* memalign(size_t align, size_t size)
+{
+   void* ptr = __libc_memalign(align, size);
+   alloc_trace_record(ptr);
+   return ptr;
+}
+
+extern "C" void* aligned_alloc(size_t align, size_t size)
+{
+   void* ptr = __libc_memalign(align, size);
+   alloc_trace_record(ptr);
+   return ptr;
+}
+
+extern "C" int posix_memalign(void** ptr_out, size_t align, size_t size)
+{
+   if (align < sizeof(void*) || (align & (align - 1)))
+      return 22; // EINVAL
+
+   void* ptr = __libc_memalign(align, size);
+   if (!ptr)
+      return 12; // ENOMEM
+
+   alloc_trace_record(ptr);
+   *ptr_out = ptr;
+   return 0;
+}
+
+// The library frames between the tool and malloc say little, the report
+// starts each stack at the first frame outside them
+static bool alloc_trace_is_library_frame(const std::string& symbol)
+{
+   const char* skipped[] = {"std::", "__gnu_cxx::", "operator new", "libstdc++", "libc.so"};
+   for (const char* prefix : skipped)
+   {
+      if (symbol.find(prefix) != std::string::npos)
+         return true;
+   }
+   return false;
+}
+
+// "binary(mangled+0x12) [0x...]" to "demangled+0x12", or "binary+0x..." for
+// functions without a dynamic symbol
+static std::string alloc_trace_frame_name(const char* symbol)
+{
+   std::string text(symbol);
+   size_t open = text.find('('), plus = text.find('+', open), close = text.find(')', open);
+   if (open == std::string::npos || plus == std::string::npos || close == std::string::npos)
+      return text;
+
+   std::string mangled = text.substr(open + 1, plus - open - 1);
+   std::string offset = text.substr(plus, close - plus);
+   if (mangled.empty())
+      return text.substr(text.find_last_of('/') + 1, open - text.find_last_of('/') - 1) + offset;
+
+   int status;
+   char* demangled = abi::__cxa_demangle(mangled.c_str(), NULL, NULL, &status);
+   if (status == 0)
+      mangled = demangled;
+   free(demangled);
+   return mangled + offset;
+}
+
+static void alloc_trace_report(FILE* out)
+{
+   // The report allocates too, so everything it prints is read up front
+   alloc_trace_busy = true;
+   alloc_trace_acquire();
+   Alloc_Totals total = alloc_trace_total;
+   Alloc_Totals phase_totals[ALLOC_TRACE_PHASES + 1];
+   memcpy(phase_totals, alloc_trace_phases, sizeof(phase_totals));
+   size_t peak = alloc_trace_peak, heap = alloc_trace_heap;
+   alloc_trace_release_lock();
+
+   fprintf(out, "Heap: %llu allocations, 0x%llx bytes allocated, peak 0x%zx bytes, 0x%zx still live\n",
+           (unsigned long long)total.count, (unsigned long long)total.bytes, peak, heap);
+
+   // Counts go to the innermost phase only
+   const std::vector<Tool_PhaseTime>& phases = tool_stats().phases;
+   fprintf(out, "%-32s %12s %14s\n", "Phase", "allocations", "bytes");
+   for (int i = 0; i <= ALLOC_TRACE_PHASES && i <= (int)phases.size(); i++)
+   {
+      if (!phase_totals[i].count) continue;
+
+      std::string name = i ? std::string(phases[i - 1].depth * 2, ' ') + phases[i - 1].name : "(outside phases)";
+      if (i == ALLOC_TRACE_PHASES)
+         name = "(later phases)";
+      fprintf(out, "%-32s %12llu %#14llx\n", name.c_str(), (unsigned long long)phase_totals[i].count, (unsigned long long)phase_totals[i].bytes);
+   }
+
+   std::vector<const Alloc_Site*> sites;
+   for (size_t i = 0; i < ALLOC_TRACE_SITES; i++)
+   {
+      if (alloc_trace_sites[i].count)
+         sites.push_back(&alloc_trace_sites[i]);
+   }
+
+   size_t top = std::min(sites.size(), (size_t)ALLOC_TRACE_TOP);
+   std::partial_sort(sites.begin(), sites.begin() + top, sites.end(), [](const Alloc_Site* a, const Alloc_Site* b)
+   {
+      return a->count > b->count;
+   });
+
+   fprintf(out, "Top call sites by allocations (%llu not attributed):\n", (unsigned long long)alloc_trace_unsited);
+   for (size_t i = 0; i < top; i++)
+   {
+      const Alloc_Site* site = sites[i];
+      char** symbols = backtrace_symbols((void* const*)site->frames, site->num_frames);
+      fprintf(out, "%10llu %#12llx ", (unsigned long long)site->count, (unsigned long long)site->bytes);
+
+      int shown = 0;
+      for (int j = 0; symbols && j < site->num_frames && shown < 3; j++)
+      {
+         std::string name = alloc_trace_frame_name(symbols[j]);
+         if (alloc_trace_is_library_frame(symbols[j]) || alloc_trace_is_library_frame(name)) continue;
+
+         fprintf(out, "%s%s", shown++ ? " <- " : "", name.c_str());
+      }
+      fprintf(out, "\n");
+      free(symbols);
+   }
+
+   alloc_trace_busy = false;
+}
+
+static const bool alloc_trace_installed = (tool_stats_report_hook() = alloc_trace_report, true);
+
+#endif // ALLOC_TRACE
+
+#endif // ALLOC_TRACE_H
@@ -4,6 +4,7 @@
 #include <stdint.h>
 
 #define MAGIC_CRO0 (0x304F5243)
+#define MAGIC_CRR0 (0x30525243)
 #define CRO_TREE_END (0x8000)
 
 enum CRO_Segment_Type
@@ -198,4 +199,28 @@ typedef struct
    }
 } CRO_Header;
 
+typedef struct
+{
+   uint32_t magic;
+   uint32_t reserved_0;
+   uint32_t offs_next;
+   uint32_t offs_prev;
+   uint32_t offs_debug_info;
+   uint32_t size_debug_info;
+   uint32_t reserved_1[2];
+   uint32_t unique_id_mask;
+   uint32_t unique_id_pattern;
+   uint32_t reserved_2[6];
+   uint8_t key_modulus[0x100];
+   uint8_t key_signature[0x100];
+   uint8_t body_signature[0x100];
+   uint32_t unique_id;
+   uint32_t size_file;
+   uint32_t reserved_3[2];
+   uint32_t offs_hashes;
+   uint32_t num_hashes;
+   uint32_t offs_plain;
+   uint32_t size_plain;
+} CRR_Header;
+
 #endif
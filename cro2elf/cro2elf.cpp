@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <cstdlib>
 #include <fstream>
 #include <unordered_map>
@@ -5,15 +6,21 @@
 #include "elfio/elfio.hpp"
 #include "elfio/elfio_dump.hpp"
 #include "cro.h"
+#include "cro_index.h"
+#include "tool_stats.h"
+#include "alloc_trace.h"
 
 using namespace ELFIO;
 
-int counts[3] = {0};
+// Relocations are buffered per target segment and written out as a single
+// .rela section each once everything is converted
+typedef std::vector<Elf32_Rela> Segment_Relocations;
+
 section* add_relocation_section(elfio& elf, section** sections, section* dynsym_sec, int segment_index)
 {
    char* secs[3] = {".text", ".rodata", ".data"};
    char rela_name[32];
-   snprintf(rela_name, 32, ".rela%s.%u", secs[segment_index], counts[segment_index]++);
+   snprintf(rela_name, 32, ".rela%s", secs[segment_index]);
    
    section* rel_sec = elf.sections.add(rela_name);
    rel_sec->set_type(SHT_RELA);
@@ -26,14 +33,85 @@ section* add_relocation_section(elfio& elf, section** sections, section* dynsym_
    return rel_sec;
 }
 
+void add_relocation(Segment_Relocations* relocs, int segment_index, Elf32_Addr offset, Elf_Word symbol, unsigned char type, Elf32_Sword addend)
+{
+   Elf32_Rela entry;
+   entry.r_offset = offset;
+   entry.r_info = ELF32_R_INFO(symbol, type);
+   entry.r_addend = addend;
+   relocs[segment_index].push_back(entry);
+   tool_stats_count(STAT_RELOCS);
+}
+
+void write_relocation_sections(elfio& elf, section** sections, section* dynsym_sec, Segment_Relocations* relocs)
+{
+   const endianess_convertor& convertor = elf.get_convertor();
+   for (int i = 0; i < 3; i++)
+   {
+      if (relocs[i].empty()) continue;
+      
+      std::stable_sort(relocs[i].begin(), relocs[i].end(), [](const Elf32_Rela& a, const Elf32_Rela& b)
+      {
+         return a.r_offset < b.r_offset;
+      });
+      
+      for (auto& entry : relocs[i])
+      {
+         entry.r_offset = convertor(entry.r_offset);
+         entry.r_info = convertor(entry.r_info);
+         entry.r_addend = convertor(entry.r_addend);
+      }
+      
+      section* rel_sec = add_relocation_section(elf, sections, dynsym_sec, i);
+      rel_sec->set_data((const char*)relocs[i].data(), relocs[i].size() * sizeof(Elf32_Rela));
+      tool_stats_count(STAT_ALLOCATIONS);
+      tool_stats_count(STAT_BYTES_COPIED, relocs[i].size() * sizeof(Elf32_Rela));
+   }
+}
+
+// A crotool index holds every CRO's imports already, so a list of CROs
+// doesn't have to be read. False for anything else, e.g. a cro_list.txt.
+bool load_cro_index(const char* path, std::vector<char>& index_data)
+{
+   FILE* index_file = fopen(path, "rb");
+   if (!index_file)
+      return false;
+
+   uint32_t magic = 0;
+   fread(&magic, sizeof(magic), 1, index_file);
+   if (magic != MAGIC_CRX0)
+   {
+      fclose(index_file);
+      return false;
+   }
+
+   fseek(index_file, 0, SEEK_END);
+   index_data.resize(ftell(index_file));
+   fseek(index_file, 0, SEEK_SET);
+   size_t read = fread(index_data.data(), sizeof(uint8_t), index_data.size(), index_file);
+   fclose(index_file);
+   tool_stats_count(STAT_ALLOCATIONS);
+   tool_stats_count(STAT_BYTES_COPIED, read);
+
+   if (read != index_data.size() || !cro_index_is_valid(index_data.data(), index_data.size()))
+   {
+      printf("%s is not a valid CRO index, reading it as a list\n", path);
+      return false;
+   }
+   return true;
+}
+
 int main(int argc, char **argv)
 {
+   Tool_Stats_Report stats_report("cro2elf", tool_stats_parse_args(argc, argv));
    if (argc < 3)
    {
-      printf("Usage: %s <input.cro> <output.elf> [cro_list.txt] [code.bin]\n", argv[0]);
+      printf("Usage: %s [--stats[=<file.json>]] <input.cro> <output.elf> [cro_list.txt|index.crx] [code.bin]\n", argv[0]);
       return -1;
    }
    
+   Tool_Phase phase("load cro");
+   
    FILE* cro_file = fopen(argv[1], "rb");
    if (!cro_file)
    {
@@ -58,23 +136,28 @@ int main(int argc, char **argv)
       fseek(static_file, 0, SEEK_END);
       static_size = ftell(static_file);
       static_data = malloc(static_size);
+      tool_stats_count(STAT_ALLOCATIONS);
       
       fseek(static_file, 0, SEEK_SET);
       fread(static_data, sizeof(uint8_t), static_size, static_file);
+      tool_stats_count(STAT_BYTES_COPIED, static_size);
       fclose(static_file);
    }
    
    fseek(cro_file, 0, SEEK_END);
    uint32_t cro_size = ftell(cro_file);
    void* cro_data = malloc(cro_size);
+   tool_stats_count(STAT_ALLOCATIONS);
    
    fseek(cro_file, 0, SEEK_SET);
    fread(cro_data, sizeof(uint8_t), cro_size, cro_file);
+   tool_stats_count(STAT_BYTES_COPIED, cro_size);
    fclose(cro_file);
    
    CRO_Header* cro_header = (CRO_Header*)cro_data;
    printf("Loaded CRO %s\n", cro_header->get_name(cro_data));
    
+   phase.next("build segments");
    elfio elf;
    elf.create(ELFCLASS32, ELFDATA2LSB);
    elf.set_os_abi(ELFOSABI_NONE);
@@ -181,12 +264,17 @@ int main(int argc, char **argv)
          }
          else
             sec->set_data((char*)cro_data + cro_segments[i].offset, cro_segments[i].size);
+         tool_stats_count(STAT_ALLOCATIONS);
+         tool_stats_count(STAT_BYTES_COPIED, cro_segments[i].size);
       }
       else
       {
          sec->set_size(cro_header->size_bss);
          seg->set_memory_size(cro_segments[i].size);
-         seg->set_file_size(cro_segments[i].size);
+         
+         // .bss has nothing in the file, a file size would make elfio claim
+         // whatever section gets laid out after it on load
+         seg->set_file_size(0);
       }
       seg->add_section_index(sec->get_index(), sec->get_addr_align());
       
@@ -222,9 +310,10 @@ int main(int argc, char **argv)
       symd.add_symbol(0, segments[i]->get_virtual_address(), 0, STB_LOCAL, STT_SECTION, 0, sections[i]->get_index());
    }
    
-   int last_rela = -1;
-   relocation_section_accessor* rel_accessor = nullptr;
+   Segment_Relocations relocs[3];
    
+   phase.next("exports");
+   tool_stats_count(STAT_SYMBOLS, cro_header->num_symbol_exports + cro_header->num_index_exports);
    for (int i = 0; i < cro_header->num_symbol_exports; i++)
    {
       CRO_Symbol* symbol = cro_header->get_export(cro_data, i);
@@ -260,6 +349,8 @@ int main(int argc, char **argv)
       symd.add_symbol(stra, name, segments[seg_idx]->get_virtual_address() + seg_offs, 0, STB_GLOBAL, STT_NOTYPE, 0, sections[seg_idx]->get_index());
    }
    
+   phase.next("imports");
+   tool_stats_count(STAT_SYMBOLS, cro_header->num_symbol_imports);
    for (int i = 0; i < cro_header->num_symbol_imports; i++)
    {
       CRO_Symbol* symbol = cro_header->get_import(cro_data, i);
@@ -277,108 +368,83 @@ int main(int argc, char **argv)
          
          //printf("rel %x %x %x %x\n", reloc->seg_offset, reloc->type, reloc->addend, reloc->last_entry);
          
-         if (last_rela != rel_seg_idx)
-         {
-            if (rel_accessor != nullptr)
-               delete rel_accessor;
-            rel_accessor = new relocation_section_accessor(elf, add_relocation_section(elf, sections, dynsym_sec, rel_seg_idx));
-         }
-         rel_accessor->add_entry(segments[rel_seg_idx]->get_virtual_address() + rel_seg_offs, index, reloc->type, reloc->addend);
-         last_rela = rel_seg_idx;
+         add_relocation(relocs, rel_seg_idx, segments[rel_seg_idx]->get_virtual_address() + rel_seg_offs, index, reloc->type, reloc->addend);
          
          if (reloc->last_entry) break;
          reloc++;
       }
    }
    
-   int module_count = 0;
-   int remaining_in_module = cro_header->get_module_entry(cro_data, module_count)->import_indexed_symbol_num;
-   for (int i = 0; i < cro_header->num_index_imports; i++)
+   // Walk each module's own index import subtable, modules may have none
+   for (int m = 0; m < cro_header->num_import_module; m++)
    {
-      CRO_ModuleEntry* module = cro_header->get_module_entry(cro_data, module_count);
+      CRO_ModuleEntry* module = cro_header->get_module_entry(cro_data, m);
+      CRO_Symbol* module_symbols = (CRO_Symbol*)((char*)cro_data + module->import_indexed_symbol_table_offset);
+      tool_stats_count(STAT_SYMBOLS, module->import_indexed_symbol_num);
 
-      CRO_Symbol* symbol = cro_header->get_index_import(cro_data, i);
-      uint32_t patch_offs = symbol->seg_offset;
-      
-      char name[256];
-      snprintf(name, 256, "import_index_%s_%u", module->get_name(cro_data), symbol->offs_name);
-      int index = symd.add_symbol(stra, name, 0x0, 0, STB_GLOBAL, STT_NOTYPE, 0, 0);
-      
-      if (patch_offs) {
-         CRO_Relocation* reloc = (CRO_Relocation*)((char*)cro_data + patch_offs);
-         while(1)
-         {
-            int rel_seg_idx = reloc->seg_offset & 0xf;
-            int rel_seg_offs = reloc->seg_offset >> 4;
-            
-            //printf("rel index %x %x %x %x\n", reloc->seg_offset, reloc->type, reloc->addend, reloc->last_entry);
-            
-            if (last_rela != rel_seg_idx)
+      for (int i = 0; i < module->import_indexed_symbol_num; i++)
+      {
+         CRO_Symbol* symbol = &module_symbols[i];
+         uint32_t patch_offs = symbol->seg_offset;
+         
+         char name[256];
+         snprintf(name, 256, "import_index_%s_%u", module->get_name(cro_data), symbol->offs_name);
+         int index = symd.add_symbol(stra, name, 0x0, 0, STB_GLOBAL, STT_NOTYPE, 0, 0);
+         
+         if (patch_offs) {
+            CRO_Relocation* reloc = (CRO_Relocation*)((char*)cro_data + patch_offs);
+            while(1)
             {
-               if (rel_accessor != nullptr)
-                  delete rel_accessor;
-               rel_accessor = new relocation_section_accessor(elf, add_relocation_section(elf, sections, dynsym_sec, rel_seg_idx));
+               int rel_seg_idx = reloc->seg_offset & 0xf;
+               int rel_seg_offs = reloc->seg_offset >> 4;
+               
+               //printf("rel index %x %x %x %x\n", reloc->seg_offset, reloc->type, reloc->addend, reloc->last_entry);
+               
+               add_relocation(relocs, rel_seg_idx, segments[rel_seg_idx]->get_virtual_address() + rel_seg_offs, index, reloc->type, reloc->addend);
+               
+               if (reloc->last_entry) break;
+               reloc++;
             }
-            rel_accessor->add_entry(segments[rel_seg_idx]->get_virtual_address() + rel_seg_offs, index, reloc->type, reloc->addend);
-            last_rela = rel_seg_idx;
-            
-            if (reloc->last_entry) break;
-            reloc++;
          }
       }
-
-      remaining_in_module -= 1;
-      if (remaining_in_module <= 0) {
-         module_count++;
-         remaining_in_module = cro_header->get_module_entry(cro_data, module_count)->import_indexed_symbol_num;
-      }
    }
    
-   module_count = 0;
-   remaining_in_module = cro_header->get_module_entry(cro_data, module_count)->import_anonymous_symbol_num;
-   for (int i = 0; i < cro_header->num_offset_imports; i++)
+   for (int m = 0; m < cro_header->num_import_module; m++)
    {
-      CRO_ModuleEntry* module = cro_header->get_module_entry(cro_data, module_count);
+      CRO_ModuleEntry* module = cro_header->get_module_entry(cro_data, m);
+      CRO_Symbol* module_symbols = (CRO_Symbol*)((char*)cro_data + module->import_anonymous_symbol_table_offset);
+      tool_stats_count(STAT_SYMBOLS, module->import_anonymous_symbol_num);
 
-      CRO_Symbol* symbol = cro_header->get_offset_import(cro_data, i);
-      uint32_t patch_offs = symbol->seg_offset;
-      int seg_idx = symbol->offs_name & 0xf;
-      int seg_offs = symbol->offs_name >> 4;
-      
-      char name[256];
-      snprintf(name, 256, "offset_import_%s_%x_%x", module->get_name(cro_data), seg_idx, seg_offs);
-      int index = symd.add_symbol(stra, name, 0x0, 0, STB_GLOBAL, STT_NOTYPE, 0, 0);
-      
-      if (patch_offs) {
-         CRO_Relocation* reloc = (CRO_Relocation*)((char*)cro_data + patch_offs);
-         while(1)
-         {
-            int rel_seg_idx = reloc->seg_offset & 0xf;
-            int rel_seg_offs = reloc->seg_offset >> 4;
-            
-            //printf("rel offset %x %x %x %x\n", reloc->seg_offset, reloc->type, reloc->addend, reloc->last_entry);
-            
-            if (last_rela != rel_seg_idx)
+      for (int i = 0; i < module->import_anonymous_symbol_num; i++)
+      {
+         CRO_Symbol* symbol = &module_symbols[i];
+         uint32_t patch_offs = symbol->seg_offset;
+         int seg_idx = symbol->offs_name & 0xf;
+         int seg_offs = symbol->offs_name >> 4;
+         
+         char name[256];
+         snprintf(name, 256, "offset_import_%s_%x_%x", module->get_name(cro_data), seg_idx, seg_offs);
+         int index = symd.add_symbol(stra, name, 0x0, 0, STB_GLOBAL, STT_NOTYPE, 0, 0);
+         
+         if (patch_offs) {
+            CRO_Relocation* reloc = (CRO_Relocation*)((char*)cro_data + patch_offs);
+            while(1)
             {
-               if (rel_accessor != nullptr)
-                  delete rel_accessor;
-               rel_accessor = new relocation_section_accessor(elf, add_relocation_section(elf, sections, dynsym_sec, rel_seg_idx));
+               int rel_seg_idx = reloc->seg_offset & 0xf;
+               int rel_seg_offs = reloc->seg_offset >> 4;
+               
+               //printf("rel offset %x %x %x %x\n", reloc->seg_offset, reloc->type, reloc->addend, reloc->last_entry);
+               
+               add_relocation(relocs, rel_seg_idx, segments[rel_seg_idx]->get_virtual_address() + rel_seg_offs, index, reloc->type, reloc->addend);
+               
+               if (reloc->last_entry) break;
+               reloc++;
             }
-            rel_accessor->add_entry(segments[rel_seg_idx]->get_virtual_address() + rel_seg_offs, index, reloc->type, reloc->addend);
-            last_rela = rel_seg_idx;
-            
-            if (reloc->last_entry) break;
-            reloc++;
          }
       }
-
-      remaining_in_module -= 1;
-      if (remaining_in_module <= 0) {
-         module_count++;
-         remaining_in_module = cro_header->get_module_entry(cro_data, module_count)->import_anonymous_symbol_num;
-      }
    }
 
+   phase.next("static relocations");
    for (int i = 0; i < cro_header->num_static_relocations; i++)
    {
       CRO_Relocation* reloc = cro_header->get_static_reloc(cro_data, i);
@@ -388,19 +454,54 @@ int main(int argc, char **argv)
          
       //printf("rel static %x %x %x %x\n", reloc->seg_offset, reloc->type, reloc->addend, reloc->last_entry);
 
-      if (last_rela != rel_seg_idx)
-      {
-         if (rel_accessor != nullptr)
-            delete rel_accessor;
-         rel_accessor = new relocation_section_accessor(elf, add_relocation_section(elf, sections, dynsym_sec, rel_seg_idx));
-      }
-      rel_accessor->add_entry(segments[rel_seg_idx]->get_virtual_address() + rel_seg_offs, ref_seg_idx+1, reloc->type, segments[ref_seg_idx]->get_virtual_address() + reloc->addend);
-      last_rela = rel_seg_idx;
+      add_relocation(relocs, rel_seg_idx, segments[rel_seg_idx]->get_virtual_address() + rel_seg_offs, ref_seg_idx+1, reloc->type, segments[ref_seg_idx]->get_virtual_address() + reloc->addend);
    }
 
-   // Gather offsets that CROs are interested in
+   phase.next("write relocations");
+   write_relocation_sections(elf, sections, dynsym_sec, relocs);
+
+   // Gather offsets that CROs are interested in, from the CROs in the list
+   // or the imports a crotool index recorded for them
+   phase.next("cross references");
    std::unordered_map<uint32_t, int> already_added_map;
-   if (argc > 3)
+   auto add_offset_import = [&](const char* module_name, uint32_t seg_offset)
+   {
+      int seg_idx = seg_offset & 0xf;
+      int seg_offs = seg_offset >> 4;
+
+      uint32_t static_addr = segments[seg_idx]->get_virtual_address() + seg_offs;
+      if (already_added_map.find(static_addr) == already_added_map.end()) {
+         char name[256];
+         snprintf(name, 256, "offset_import_%s_%x_%x", module_name, seg_idx, seg_offs);
+         symd.add_symbol(stra, name, static_addr, 0, STB_GLOBAL, STT_NOTYPE, 0, sections[seg_idx]->get_index());
+
+         already_added_map[static_addr] = 1;
+         printf("%s\n", name);
+      }
+   };
+
+   std::vector<char> index_data;
+   if (argc > 3 && load_cro_index(argv[3], index_data))
+   {
+      const CRO_Index_Header* index_header = (const CRO_Index_Header*)index_data.data();
+      printf("Loading info from index %s\n", argv[3]);
+      for (uint32_t m = 0; m < index_header->num_modules; m++)
+      {
+         const CRO_Index_Module* module = index_header->get_module(index_data.data(), m);
+         if (!strcmp(index_header->get_string(index_data.data(), module->offs_name), cro_header->get_name(cro_data))) continue;
+
+         for (uint32_t i = module->first_import; i < module->first_import + module->num_imports; i++)
+         {
+            const CRO_Index_Import* import = index_header->get_import(index_data.data(), i);
+            const char* module_name = index_header->get_string(index_data.data(), import->offs_module);
+            if (import->kind != INDEX_IMPORT_OFFSET || strcmp(module_name, cro_header->get_name(cro_data))) continue;
+
+            tool_stats_count(STAT_SYMBOLS);
+            add_offset_import(module_name, import->value);
+         }
+      }
+   }
+   else if (argc > 3)
    {
       std::ifstream file(argv[3]);
       if (file.is_open()) {
@@ -416,9 +517,11 @@ int main(int argc, char **argv)
             fseek(cro_file_2, 0, SEEK_END);
             uint32_t cro_size_2 = ftell(cro_file_2);
             void* cro_data_2 = malloc(cro_size_2);
+            tool_stats_count(STAT_ALLOCATIONS);
             
             fseek(cro_file_2, 0, SEEK_SET);
             fread(cro_data_2, sizeof(uint8_t), cro_size_2, cro_file_2);
+            tool_stats_count(STAT_BYTES_COPIED, cro_size_2);
             fclose(cro_file_2);
             
             CRO_Header* cro_header_2 = (CRO_Header*)cro_data_2;
@@ -429,32 +532,15 @@ int main(int argc, char **argv)
                continue;
             }
 
-            module_count = 0;
-            remaining_in_module = cro_header_2->get_module_entry(cro_data_2, module_count)->import_anonymous_symbol_num;
-            for (int i = 0; i < cro_header_2->num_offset_imports; i++)
+            for (int m = 0; m < cro_header_2->num_import_module; m++)
             {
-               CRO_ModuleEntry* module = cro_header_2->get_module_entry(cro_data_2, module_count);
-
-               CRO_Symbol* symbol = cro_header_2->get_offset_import(cro_data_2, i);
-               uint32_t patch_offs = symbol->seg_offset;
-               int seg_idx = symbol->offs_name & 0xf;
-               int seg_offs = symbol->offs_name >> 4;
-
-               uint32_t static_addr = segments[seg_idx]->get_virtual_address() + seg_offs;
-               if (!strcmp(module->get_name(cro_data_2), cro_header->get_name(cro_data)) && already_added_map.find(static_addr) == already_added_map.end()) {
-                  char name[256];
-                  snprintf(name, 256, "offset_import_%s_%x_%x", module->get_name(cro_data_2), seg_idx, seg_offs);
-                  int index = symd.add_symbol(stra, name, static_addr, 0, STB_GLOBAL, STT_NOTYPE, 0, sections[seg_idx]->get_index());
-
-                  already_added_map[static_addr] = 1;
-                  printf("%s\n", name);
-               }
-
-               remaining_in_module -= 1;
-               if (remaining_in_module <= 0) {
-                  module_count++;
-                  remaining_in_module = cro_header_2->get_module_entry(cro_data_2, module_count)->import_anonymous_symbol_num;
-               }
+               CRO_ModuleEntry* module = cro_header_2->get_module_entry(cro_data_2, m);
+               if (strcmp(module->get_name(cro_data_2), cro_header->get_name(cro_data))) continue;
+               
+               CRO_Symbol* module_symbols = (CRO_Symbol*)((char*)cro_data_2 + module->import_anonymous_symbol_table_offset);
+               tool_stats_count(STAT_SYMBOLS, module->import_anonymous_symbol_num);
+               for (int i = 0; i < module->import_anonymous_symbol_num; i++)
+                  add_offset_import(module->get_name(cro_data_2), module_symbols[i].offs_name);
             }
 
             free(cro_data_2);
@@ -463,6 +549,7 @@ int main(int argc, char **argv)
       }
    }
    
+   phase.next("save");
    elf.save(argv[2]);
 
    return 0;
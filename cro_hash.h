@@ -0,0 +1,78 @@
+#ifndef CRO_HASH_H
+#define CRO_HASH_H
+
+#include <thread>
+#include <vector>
+
+#include "cro.h"
+#include "sha256.h"
+
+// CRO_Header::hash_table holds four SHA-256 hashes, checked by the loader
+// before the CRR hash of the table itself:
+//    0: 0x80 up to the code region (rest of the header)
+//    1: the code region (.text and .rodata)
+//    2: the code region up to .data (linking tables)
+//    3: .data
+#define CRO_HASH_REGIONS (4)
+#define CRO_HASH_SIZE (0x20)
+
+// Small modules aren't worth a thread per region
+#define CRO_HASH_PARALLEL_MIN (0x40000)
+
+inline bool cro_get_hash_regions(const void* cro_data, size_t cro_size, size_t offsets[CRO_HASH_REGIONS], size_t sizes[CRO_HASH_REGIONS])
+{
+   if (cro_size < sizeof(CRO_Header)) return false;
+
+   const CRO_Header* cro_header = (const CRO_Header*)cro_data;
+   size_t code_end = (size_t)cro_header->offs_text + cro_header->size_text;
+   size_t data_end = (size_t)cro_header->offs_data + cro_header->size_data;
+
+   if (cro_header->magic != MAGIC_CRO0 || cro_header->offs_text < sizeof(cro_header->hash_table)
+       || code_end > cro_header->offs_data || data_end > cro_size)
+      return false;
+
+   offsets[0] = sizeof(cro_header->hash_table);
+   sizes[0] = cro_header->offs_text - offsets[0];
+   offsets[1] = cro_header->offs_text;
+   sizes[1] = cro_header->size_text;
+   offsets[2] = code_end;
+   sizes[2] = cro_header->offs_data - code_end;
+   offsets[3] = cro_header->offs_data;
+   sizes[3] = cro_header->size_data;
+   return true;
+}
+
+inline bool cro_hash_regions(const void* cro_data, size_t cro_size, uint8_t hash_table[CRO_HASH_REGIONS * CRO_HASH_SIZE], bool parallel)
+{
+   size_t offsets[CRO_HASH_REGIONS], sizes[CRO_HASH_REGIONS];
+   if (!cro_get_hash_regions(cro_data, cro_size, offsets, sizes))
+      return false;
+
+   // The code region dominates, so it stays on this thread while the
+   // others run alongside
+   std::vector<std::thread> workers;
+   for (int i = 0; i < CRO_HASH_REGIONS; i++)
+   {
+      const uint8_t* region = (const uint8_t*)cro_data + offsets[i];
+      uint8_t* hash = hash_table + i * CRO_HASH_SIZE;
+      if (parallel && i != 1 && cro_size >= CRO_HASH_PARALLEL_MIN)
+         workers.push_back(std::thread(sha256, region, sizes[i], hash));
+      else if (i != 1)
+         sha256(region, sizes[i], hash);
+   }
+
+   sha256((const uint8_t*)cro_data + offsets[1], sizes[1], hash_table + CRO_HASH_SIZE);
+   for (auto& worker : workers)
+      worker.join();
+
+   return true;
+}
+
+// Fills in the header's hash table, the last thing to do before writing a CRO
+inline bool cro_update_hash_table(void* cro_data, size_t cro_size, bool parallel = true)
+{
+   CRO_Header* cro_header = (CRO_Header*)cro_data;
+   return cro_hash_regions(cro_data, cro_size, cro_header->hash_table, parallel);
+}
+
+#endif // CRO_HASH_H
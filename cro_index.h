@@ -0,0 +1,175 @@
+#ifndef CRO_INDEX_H
+#define CRO_INDEX_H
+
+#include <stdint.h>
+#include <string.h>
+
+// Cross-reference index of a set of CROs, written by `crotool index`. Every
+// table is a sorted array and every name an offset into one string pool, so
+// the file is used where it's loaded or mapped without any parsing:
+//    modules        sorted by name
+//    exports        each module's named exports, sorted by name
+//    index exports  each module's index export seg_offsets, by slot
+//    imports        each module's imports, sorted by kind, exporting module, value
+//    strings        NUL terminated, deduplicated, "" at offset 0
+#define MAGIC_CRX0 (0x30585243)
+#define CRO_INDEX_VERSION (2)
+
+enum CRO_Index_Import_Kind
+{
+   INDEX_IMPORT_NAMED = 0,
+   INDEX_IMPORT_INDEX = 1,
+   INDEX_IMPORT_OFFSET = 2,
+};
+
+typedef struct
+{
+   uint32_t offs_name;
+   uint32_t first_export;
+   uint32_t num_exports;
+   uint32_t first_import;
+   uint32_t num_imports;
+   uint32_t first_index_export;
+   uint32_t num_index_exports;
+} CRO_Index_Module;
+
+typedef struct
+{
+   uint32_t offs_name;
+   uint32_t seg_offset;
+} CRO_Index_Export;
+
+typedef struct
+{
+   uint32_t kind;
+   uint32_t offs_module; // exporting module, "" for named imports
+   uint32_t value;       // name for named imports, export index, or the exporter's seg_offset
+   uint32_t num_patches;
+} CRO_Index_Import;
+
+typedef struct
+{
+   uint32_t magic;
+   uint32_t version;
+   uint32_t size_file;
+   uint32_t offs_modules;
+   uint32_t num_modules;
+   uint32_t offs_exports;
+   uint32_t num_exports;
+   uint32_t offs_index_exports;
+   uint32_t num_index_exports;
+   uint32_t offs_imports;
+   uint32_t num_imports;
+   uint32_t offs_strings;
+   uint32_t size_strings;
+
+   const CRO_Index_Module* get_module(const void* index_data, uint32_t index) const
+   {
+      return (const CRO_Index_Module*)((const char*)index_data + offs_modules) + index;
+   }
+
+   const CRO_Index_Export* get_export(const void* index_data, uint32_t index) const
+   {
+      return (const CRO_Index_Export*)((const char*)index_data + offs_exports) + index;
+   }
+
+   uint32_t get_index_export(const void* index_data, uint32_t index) const
+   {
+      return ((const uint32_t*)((const char*)index_data + offs_index_exports))[index];
+   }
+
+   const CRO_Index_Import* get_import(const void* index_data, uint32_t index) const
+   {
+      return (const CRO_Index_Import*)((const char*)index_data + offs_imports) + index;
+   }
+
+   const char* get_string(const void* index_data, uint32_t offset) const
+   {
+      return (const char*)index_data + offs_strings + offset;
+   }
+} CRO_Index_Header;
+
+inline bool cro_index_table_fits(size_t index_size, uint32_t offset, uint32_t count, size_t entry_size)
+{
+   return offset <= index_size && count <= (index_size - offset) / entry_size;
+}
+
+// Checks the tables and that every offset stays inside them, after this the
+// accessors are safe to use on anything the index points at
+inline bool cro_index_is_valid(const void* index_data, size_t index_size)
+{
+   if (index_size < sizeof(CRO_Index_Header))
+      return false;
+
+   const CRO_Index_Header* header = (const CRO_Index_Header*)index_data;
+   if (header->magic != MAGIC_CRX0 || header->version != CRO_INDEX_VERSION || header->size_file != index_size
+       || !cro_index_table_fits(index_size, header->offs_modules, header->num_modules, sizeof(CRO_Index_Module))
+       || !cro_index_table_fits(index_size, header->offs_exports, header->num_exports, sizeof(CRO_Index_Export))
+       || !cro_index_table_fits(index_size, header->offs_index_exports, header->num_index_exports, sizeof(uint32_t))
+       || !cro_index_table_fits(index_size, header->offs_imports, header->num_imports, sizeof(CRO_Index_Import))
+       || !cro_index_table_fits(index_size, header->offs_strings, header->size_strings, 1)
+       || !header->size_strings || *header->get_string(index_data, header->size_strings - 1))
+      return false;
+
+   for (uint32_t i = 0; i < header->num_modules; i++)
+   {
+      const CRO_Index_Module* module = header->get_module(index_data, i);
+      if (module->offs_name >= header->size_strings
+          || module->first_export > header->num_exports || module->num_exports > header->num_exports - module->first_export
+          || module->first_import > header->num_imports || module->num_imports > header->num_imports - module->first_import
+          || module->first_index_export > header->num_index_exports
+          || module->num_index_exports > header->num_index_exports - module->first_index_export)
+         return false;
+   }
+   for (uint32_t i = 0; i < header->num_exports; i++)
+   {
+      if (header->get_export(index_data, i)->offs_name >= header->size_strings)
+         return false;
+   }
+   for (uint32_t i = 0; i < header->num_imports; i++)
+   {
+      const CRO_Index_Import* import = header->get_import(index_data, i);
+      if (import->offs_module >= header->size_strings || (import->kind == INDEX_IMPORT_NAMED && import->value >= header->size_strings))
+         return false;
+   }
+   return true;
+}
+
+// Binary searches of the sorted tables, NULL when the name isn't there
+inline const CRO_Index_Module* cro_index_find_module(const void* index_data, const char* name)
+{
+   const CRO_Index_Header* header = (const CRO_Index_Header*)index_data;
+   uint32_t low = 0, high = header->num_modules;
+   while (low < high)
+   {
+      uint32_t mid = low + (high - low) / 2;
+      int order = strcmp(header->get_string(index_data, header->get_module(index_data, mid)->offs_name), name);
+      if (order == 0)
+         return header->get_module(index_data, mid);
+      if (order < 0)
+         low = mid + 1;
+      else
+         high = mid;
+   }
+   return NULL;
+}
+
+inline const CRO_Index_Export* cro_index_find_export(const void* index_data, const CRO_Index_Module* module, const char* name)
+{
+   const CRO_Index_Header* header = (const CRO_Index_Header*)index_data;
+   uint32_t low = module->first_export, high = module->first_export + module->num_exports;
+   while (low < high)
+   {
+      uint32_t mid = low + (high - low) / 2;
+      int order = strcmp(header->get_string(index_data, header->get_export(index_data, mid)->offs_name), name);
+      if (order == 0)
+         return header->get_export(index_data, mid);
+      if (order < 0)
+         low = mid + 1;
+      else
+         high = mid;
+   }
+   return NULL;
+}
+
+#endif // CRO_INDEX_H
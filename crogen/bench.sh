@@ -0,0 +1,91 @@
+#!/bin/sh
+# Times elf2cro, cro2elf and elfinject on generated modules of growing size
+# and flags any tool whose time grows faster than its input.
+#
+# Usage: bench.sh [sizes...]    (default: 1000 10000 100000 1000000)
+#
+# Build crogen and the tools first. Set BENCH_DIR to keep the generated files,
+# and SUPERLINEAR to the growth factor (over the size ratio) that gets
+# flagged, 2 by default.
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+SIZES=${*:-"1000 10000 100000 1000000"}
+SUPERLINEAR=${SUPERLINEAR:-2}
+WORK=${BENCH_DIR:-$(mktemp -d)}
+mkdir -p "$WORK"
+
+for tool in crogen/crogen elf2cro/elf2cro cro2elf/cro2elf elfinject/elfinject; do
+   if [ ! -x "$ROOT/$tool" ]; then
+      echo "$ROOT/$tool is missing, build it first"
+      exit 1
+   fi
+done
+
+# elf2cro's export limit, read from the trie so the two can't disagree
+max_exports=$(($(sed -n 's/.*max_keys = \(0x[0-9A-Fa-f]*\);.*/\1/p' "$ROOT/elf2cro/bit_trie.h")))
+
+# total_ms from a --stats report
+total_ms() {
+   sed -n 's/.*"total_ms": \([0-9.]*\).*/\1/p' "$1"
+}
+
+# run <tool> <stats.json> <args...>
+run() {
+   tool=$1
+   stats=$2
+   shift 2
+   if ! "$ROOT/$tool/$tool" --stats="$stats" "$@" > "$WORK/$tool.log" 2>&1; then
+      echo "$tool failed, see $WORK/$tool.log"
+      exit 1
+   fi
+}
+
+# The payload stays small, elfinject is timed on how it handles a big base
+"$ROOT/crogen/crogen" --payload --exports 64 --imports 32 --import-relocs 256 --static-relocs 256 \
+   --text 0x1000 --rodata 0x100 --data 0x100 --bss 0x40 "$WORK/payload.elf" > /dev/null || exit 1
+
+printf "%10s %12s %12s %12s\n" symbols elf2cro cro2elf elfinject
+prev_size=
+flagged=0
+for size in $SIZES; do
+   # Past the export tree's limit the extra symbols are imports
+   exports=$((size / 4))
+   [ $exports -gt $max_exports ] && exports=$max_exports
+
+   "$ROOT/crogen/crogen" --exports $exports --imports $((size - exports)) --import-relocs "$size" --static-relocs "$size" \
+      --text $((size * 16)) --rodata $((size * 4)) --data $((size * 4)) --bss $((size * 4)) \
+      --name-len 24 "$WORK/bench_$size.elf" > /dev/null || exit 1
+
+   run elf2cro "$WORK/elf2cro_$size.json" "$WORK/bench_$size.elf" "$WORK/bench_$size.cro"
+   run cro2elf "$WORK/cro2elf_$size.json" "$WORK/bench_$size.cro" "$WORK/bench_$size.rt.elf"
+   # Without last run's manifest, so elfinject does a full injection
+   rm -f "$WORK/bench_$size.inj.elf.inject"
+   run elfinject "$WORK/elfinject_$size.json" "$WORK/bench_$size.rt.elf" "$WORK/payload.elf" "$WORK/bench_$size.inj.elf"
+
+   line=$(printf "%10s" "$size")
+   for tool in elf2cro cro2elf elfinject; do
+      ms=$(total_ms "$WORK/${tool}_$size.json")
+      line="$line $(printf "%10s" "$ms")ms"
+
+      if [ -n "$prev_size" ]; then
+         prev_ms=$(total_ms "$WORK/${tool}_$prev_size.json")
+         if awk -v t="$ms" -v pt="$prev_ms" -v s="$size" -v ps="$prev_size" -v f="$SUPERLINEAR" \
+               'BEGIN { exit !(pt > 1 && t / pt > (s / ps) * f) }'; then
+            flags="$flags\n   $tool: ${prev_ms}ms at $prev_size -> ${ms}ms at $size"
+            flagged=1
+         fi
+      fi
+   done
+   echo "$line"
+   prev_size=$size
+done
+
+if [ $flagged -ne 0 ]; then
+   printf "Superlinear growth (more than ${SUPERLINEAR}x the size ratio):$flags\n"
+fi
+
+if [ -z "$BENCH_DIR" ]; then
+   rm -rf "$WORK"
+else
+   echo "Inputs, outputs and --stats reports are in $WORK"
+fi
@@ -0,0 +1,263 @@
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "elfio/elfio.hpp"
+
+using namespace ELFIO;
+
+// Writes synthetic ARM ELFs in the shape cro2elf produces and elf2cro
+// expects: .text, .rodata, .data, .bss and .cro_info segments in that order,
+// section symbols at 1-5 of .dynsym, then exports, then imports, with one
+// RELA section per patched segment. Contents are random but reproducible
+// from the seed, so the tools can be timed on any size without devkitARM.
+typedef struct
+{
+   size_t exports;
+   size_t imports;
+   size_t import_relocs;
+   size_t static_relocs;
+   size_t segment_sizes[4]; // .text, .rodata, .data, .bss
+   size_t name_len;
+   size_t seed;
+   bool interleave;
+   bool payload;
+} CROGen_Options;
+
+static uint32_t rng_state = 1;
+
+uint32_t gen_random()
+{
+   rng_state = rng_state * 1103515245 + 12345;
+   return rng_state >> 8;
+}
+
+size_t align_up(size_t value, size_t align)
+{
+   return value + (align - value % align) % align;
+}
+
+// Names are unique by prefix and number, padded with letters out to name_len.
+// A payload exports some of the base module's names so elfinject has
+// overrides to handle, and imports others of them.
+std::string gen_symbol_name(const char* prefix, size_t number, size_t name_len)
+{
+   char buf[64];
+   snprintf(buf, sizeof(buf), "%s%zu_", prefix, number);
+   std::string name(buf);
+
+   uint32_t hash = number * 2654435761u + 1;
+   while (name.size() < name_len)
+   {
+      hash = hash * 1103515245 + 12345;
+      name += (char)('a' + (hash >> 16) % 26);
+   }
+   return name;
+}
+
+uint32_t gen_segment_offset(size_t segment_size)
+{
+   if (segment_size < 4) return 0;
+   return (gen_random() % (segment_size / 4)) * 4;
+}
+
+void print_usage(char* name)
+{
+   printf("Usage: %s [options] <output.elf>\n", name);
+   printf("Options:\n");
+   printf("  --exports <n>        Exported symbols, spread over .text, .rodata and .data (100)\n");
+   printf("  --imports <n>        Imported symbols (50)\n");
+   printf("  --import-relocs <n>  Relocations against imports (200)\n");
+   printf("  --static-relocs <n>  Relocations between the module's own segments (200)\n");
+   printf("  --text <size>        .text size (0x2000)\n");
+   printf("  --rodata <size>      .rodata size (0x800)\n");
+   printf("  --data <size>        .data size (0x400)\n");
+   printf("  --bss <size>         .bss size (0x100)\n");
+   printf("  --name-len <n>       Pad symbol names out to n characters (16)\n");
+   printf("  --seed <n>           Random seed (1)\n");
+   printf("  --interleave         Patch imports in random order instead of one run each\n");
+   printf("  --payload            Write an elfinject payload: code relocations only, some\n");
+   printf("                       exports overriding and imports naming the base's exports\n");
+}
+
+int main(int argc, char **argv)
+{
+   CROGen_Options options = {100, 50, 200, 200, {0x2000, 0x800, 0x400, 0x100}, 16, 1, false, false};
+   const char* output_path = NULL;
+   for (int i = 1; i < argc; i++)
+   {
+      const char* numeric[] = {"--exports", "--imports", "--import-relocs", "--static-relocs", "--text", "--rodata", "--data", "--bss", "--name-len", "--seed"};
+      size_t* values[] = {&options.exports, &options.imports, &options.import_relocs, &options.static_relocs,
+                          &options.segment_sizes[0], &options.segment_sizes[1], &options.segment_sizes[2], &options.segment_sizes[3],
+                          &options.name_len, &options.seed};
+
+      int option = -1;
+      for (int j = 0; j < sizeof(numeric) / sizeof(numeric[0]); j++)
+      {
+         if (!strcmp(argv[i], numeric[j]))
+            option = j;
+      }
+
+      if (option != -1 && i + 1 < argc)
+         *values[option] = strtoull(argv[++i], NULL, 0);
+      else if (!strcmp(argv[i], "--interleave"))
+         options.interleave = true;
+      else if (!strcmp(argv[i], "--payload"))
+         options.payload = true;
+      else if (argv[i][0] != '-' && !output_path)
+         output_path = argv[i];
+      else
+      {
+         print_usage(argv[0]);
+         return -1;
+      }
+   }
+
+   if (!output_path)
+   {
+      print_usage(argv[0]);
+      return -1;
+   }
+   rng_state = options.seed;
+
+   elfio elf;
+   elf.create(ELFCLASS32, ELFDATA2LSB);
+   elf.set_os_abi(ELFOSABI_NONE);
+   elf.set_type(ET_DYN);
+   elf.set_machine(EM_ARM);
+
+   // Payloads are packed, modules keep elf2cro's page aligned segments
+   size_t segment_align = options.payload ? 0x4 : 0x1000;
+   uint32_t base[5], size[5];
+   base[0] = 0x180;
+   size[0] = options.segment_sizes[0];
+   base[1] = align_up(base[0] + size[0], segment_align);
+   size[1] = options.segment_sizes[1];
+   base[2] = align_up(base[1] + size[1], segment_align);
+   size[2] = options.segment_sizes[2];
+   base[3] = base[2] + size[2];
+   size[3] = options.segment_sizes[3];
+   base[4] = 0;
+   size[4] = 0;
+
+   const char* section_names[5] = {".text", ".rodata", ".data", ".bss", ".cro_info"};
+   const Elf_Word segment_flags[5] = {PF_R | PF_X, PF_R, PF_R | PF_W, PF_R | PF_W, PF_R | PF_X};
+   const Elf_Xword section_flags[5] = {SHF_ALLOC | SHF_EXECINSTR, SHF_ALLOC, SHF_ALLOC | SHF_WRITE, SHF_ALLOC | SHF_WRITE, SHF_ALLOC | SHF_EXECINSTR};
+   section* sections[5];
+   for (int i = 0; i < 5; i++)
+   {
+      segment* seg = elf.segments.add();
+      seg->set_type(PT_LOAD);
+      seg->set_flags(segment_flags[i]);
+      seg->set_align(0x4);
+      seg->set_virtual_address(base[i]);
+      seg->set_physical_address(base[i]);
+      seg->set_memory_size(size[i]);
+      seg->set_file_size(i == 3 ? 0 : size[i]);
+
+      section* sec = elf.sections.add(section_names[i]);
+      sec->set_type(i == 3 ? SHT_NOBITS : SHT_PROGBITS);
+      sec->set_flags(section_flags[i]);
+      sec->set_addr_align(4);
+      sec->set_address(base[i]);
+      if (i == 3)
+         sec->set_size(size[i]);
+      else
+      {
+         std::vector<char> data(size[i]);
+         for (size_t k = 0; k < data.size(); k++)
+            data[k] = gen_random();
+         sec->set_data(data.data(), data.size());
+      }
+
+      seg->add_section_index(sec->get_index(), sec->get_addr_align());
+      sections[i] = sec;
+   }
+
+   section* strtab_sec = elf.sections.add(".dynstr");
+   strtab_sec->set_type(SHT_STRTAB);
+   strtab_sec->set_flags(SHF_ALLOC);
+   strtab_sec->set_overlay(sections[0]->get_index());
+   strtab_sec->set_addr_align(1);
+   string_section_accessor stra(strtab_sec);
+
+   section* dynsym_sec = elf.sections.add(".dynsym");
+   dynsym_sec->set_type(SHT_DYNSYM);
+   dynsym_sec->set_flags(SHF_ALLOC);
+   dynsym_sec->set_entry_size(elf.get_default_entry_size(SHT_SYMTAB));
+   dynsym_sec->set_link(strtab_sec->get_index());
+   dynsym_sec->set_info(5+1);
+   dynsym_sec->set_overlay(sections[0]->get_index());
+   dynsym_sec->set_addr_align(4);
+   symbol_section_accessor symd(elf, dynsym_sec);
+
+   for (int i = 0; i < 5; i++)
+      symd.add_symbol(0, base[i], 0, STB_LOCAL, STT_SECTION, 0, sections[i]->get_index());
+
+   for (size_t i = 0; i < options.exports; i++)
+   {
+      int seg = i % 3;
+      std::string name = options.payload && i % 4 ? gen_symbol_name("inj", i, options.name_len)
+                                                   : gen_symbol_name("exp", options.payload ? i * 5 : i, options.name_len);
+      symd.add_symbol(stra, name.c_str(), base[seg] + gen_segment_offset(size[seg]), 4, STB_GLOBAL, STT_FUNC, 0, sections[seg]->get_index());
+   }
+
+   Elf_Word first_import = 5 + 1 + options.exports;
+   for (size_t i = 0; i < options.imports; i++)
+   {
+      std::string name = options.payload ? gen_symbol_name("exp", i * 7 + 1, options.name_len)
+                                         : gen_symbol_name("imp", i, options.name_len);
+      symd.add_symbol(stra, name.c_str(), 0, 0, STB_GLOBAL, STT_NOTYPE, 0, 0);
+   }
+
+   // Entries are written once per section instead of growing it per entry
+   std::vector<Elf32_Rela> relocs[3];
+   for (size_t i = 0; i < options.import_relocs && options.imports; i++)
+   {
+      size_t symbol = options.interleave ? gen_random() % options.imports : i * options.imports / options.import_relocs;
+      int seg = options.payload ? 0 : gen_random() % 3;
+
+      Elf32_Rela entry;
+      entry.r_offset = base[seg] + gen_segment_offset(size[seg]);
+      entry.r_info = ELF32_R_INFO(first_import + symbol, R_ARM_ABS32);
+      entry.r_addend = 0;
+      relocs[seg].push_back(entry);
+   }
+
+   for (size_t i = 0; i < options.static_relocs; i++)
+   {
+      int seg = options.payload ? 0 : gen_random() % 3;
+      int target_seg = options.payload ? 0 : gen_random() % 3;
+
+      Elf32_Rela entry;
+      entry.r_offset = base[seg] + gen_segment_offset(size[seg]);
+      entry.r_info = ELF32_R_INFO(target_seg + 1, R_ARM_ABS32);
+      entry.r_addend = base[target_seg] + gen_segment_offset(size[target_seg]);
+      relocs[seg].push_back(entry);
+   }
+
+   const char* rela_names[3] = {".rela.text", ".rela.rodata", ".rela.data"};
+   for (int i = 0; i < 3; i++)
+   {
+      section* rel_sec = elf.sections.add(rela_names[i]);
+      rel_sec->set_type(SHT_RELA);
+      rel_sec->set_entry_size(elf.get_default_entry_size(SHT_RELA));
+      rel_sec->set_flags(SHF_ALLOC | SHF_INFO_LINK);
+      rel_sec->set_info(sections[i]->get_index());
+      rel_sec->set_overlay(sections[i]->get_index());
+      rel_sec->set_link(dynsym_sec->get_index());
+      rel_sec->set_addr_align(4);
+      if (!relocs[i].empty())
+         rel_sec->set_data((const char*)relocs[i].data(), relocs[i].size() * sizeof(Elf32_Rela));
+   }
+
+   if (!elf.save(output_path))
+   {
+      printf("Failed to open file %s for writing! Exiting...\n", output_path);
+      return -1;
+   }
+
+   printf("Wrote %zu exports, %zu imports, %zu relocations\n", options.exports, options.imports, options.import_relocs + options.static_relocs);
+   return 0;
+}
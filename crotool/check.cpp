@@ -0,0 +1,344 @@
+#include <algorithm>
+#include <cstdarg>
+#include <cstring>
+#include <unordered_map>
+
+#include "crotool.h"
+#include "cro_index.h"
+
+// A module's exports both ways, built once and shared by every worker
+typedef struct
+{
+   std::unordered_map<std::string, uint32_t> by_name; // name -> seg_offset
+   std::unordered_map<uint32_t, std::string> by_offset;
+} Check_Exports;
+
+typedef struct
+{
+   size_t imports;
+   size_t unresolved;
+   size_t changed;
+   std::vector<std::string> problems;
+} Check_Result;
+
+// What the baseline index says a module exported, by offset
+typedef struct
+{
+   const char* data;
+   std::unordered_map<std::string, const CRO_Index_Module*> modules;
+   std::unordered_map<std::string, std::string> named_exporters; // export -> first module exporting it
+   std::vector<std::unordered_multimap<uint32_t, const char*>> names_by_offset; // aliases share an offset
+} Check_Baseline;
+
+typedef struct
+{
+   const std::vector<CRO_Module>& modules;
+   std::vector<Check_Exports> exports;
+   std::unordered_map<std::string, int> module_index;
+   std::unordered_map<std::string, int> named_exporters; // first in load order wins
+   const Check_Baseline* baseline;
+} Check_Title;
+
+static std::string format(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+
+static std::string format(const char* fmt, ...)
+{
+   char buf[1024];
+   va_list args;
+   va_start(args, fmt);
+   vsnprintf(buf, sizeof(buf), fmt, args);
+   va_end(args);
+   return buf;
+}
+
+static bool seg_offset_valid(const CRO_Module& module, uint32_t seg_offset)
+{
+   uint32_t seg_idx = seg_offset & 0xf;
+   return seg_idx < module_header(module)->num_segments && (seg_offset >> 4) < module_segments(module)[seg_idx].size;
+}
+
+// "name" for an export at seg_offset, "<segment>+<offset>" for anything else
+static std::string describe_target(const Check_Exports& exports, uint32_t seg_offset)
+{
+   auto found = exports.by_offset.find(seg_offset);
+   if (found != exports.by_offset.end())
+      return found->second;
+   return format("%u+0x%x", seg_offset & 0xf, seg_offset >> 4);
+}
+
+// Every name the baseline had at seg_offset, aliases included
+static std::vector<const char*> baseline_names_at(const Check_Baseline* baseline, const std::string& module, uint32_t seg_offset)
+{
+   std::vector<const char*> names;
+   if (!baseline) return names;
+
+   auto found = baseline->modules.find(module);
+   if (found == baseline->modules.end()) return names;
+
+   const CRO_Index_Header* header = (const CRO_Index_Header*)baseline->data;
+   auto range = baseline->names_by_offset[found->second - header->get_module(baseline->data, 0)].equal_range(seg_offset);
+   for (auto name = range.first; name != range.second; name++)
+      names.push_back(name->second);
+   return names;
+}
+
+// A slot or offset import that named an export in the baseline should still
+// land on that export, or on one of its aliases
+static void check_same_target(const Check_Title& title, const std::string& exporter, const Check_Exports& exports, uint32_t old_seg_offset,
+                              uint32_t seg_offset, const std::string& what, Check_Result& result)
+{
+   std::vector<const char*> old_names = baseline_names_at(title.baseline, exporter, old_seg_offset);
+   if (old_names.empty()) return;
+
+   const char* old_name = old_names[0];
+   auto found = exports.by_name.end();
+   for (const char* name : old_names)
+   {
+      auto alias = exports.by_name.find(name);
+      if (alias == exports.by_name.end()) continue;
+      if (alias->second == seg_offset) return;
+      if (found == exports.by_name.end())
+      {
+         old_name = name;
+         found = alias;
+      }
+   }
+
+   result.changed++;
+   if (found == exports.by_name.end())
+      result.problems.push_back(format("changed %s: was %s, which %s no longer exports", what.c_str(), old_name, exporter.c_str()));
+   else if (seg_offset == old_seg_offset)
+      result.problems.push_back(format("changed %s: was %s, which moved to %u+0x%x", what.c_str(), old_name, found->second & 0xf, found->second >> 4));
+   else
+      result.problems.push_back(format("changed %s: was %s, now lands on %s", what.c_str(), old_name, describe_target(exports, seg_offset).c_str()));
+}
+
+static void check_named_import(const Check_Title& title, const std::string& name, uint32_t patches, Check_Result& result)
+{
+   auto found = title.named_exporters.find(name);
+   const Check_Baseline* baseline = title.baseline;
+   auto old = baseline ? baseline->named_exporters.find(name) : std::unordered_map<std::string, std::string>::const_iterator();
+   bool was_resolved = baseline && old != baseline->named_exporters.end();
+   if (found == title.named_exporters.end())
+   {
+      result.unresolved++;
+      result.problems.push_back(format("unresolved named import %s (%u patches)%s%s", name.c_str(), patches,
+                                       was_resolved ? ", was exported by " : "", was_resolved ? old->second.c_str() : ""));
+      return;
+   }
+   if (!baseline) return;
+
+   // Named imports follow their export wherever it moves, only a different
+   // exporting module is a change
+   const std::string& exporter = title.modules[found->second].name;
+   auto old_module = baseline->modules.find(exporter);
+   if (old_module == baseline->modules.end() || !cro_index_find_export(baseline->data, old_module->second, name.c_str()))
+   {
+      result.changed++;
+      result.problems.push_back(format("changed named import %s (%u patches): now exported by %s, was %s", name.c_str(), patches, exporter.c_str(),
+                                       was_resolved ? old->second.c_str() : "unresolved"));
+   }
+}
+
+static void check_module(const Check_Title& title, size_t module_index, Check_Result& result)
+{
+   const CRO_Module& module = title.modules[module_index];
+   const CRO_Header* cro_header = module_header(module);
+
+   for (uint32_t i = 0; i < cro_header->num_symbol_imports; i++)
+   {
+      const CRO_Symbol* symbol = (const CRO_Symbol*)(module.file.data + cro_header->offs_symbol_imports) + i;
+      result.imports++;
+      check_named_import(title, module_string(module, symbol->offs_name), module_chain_length(module, symbol->seg_offset), result);
+   }
+
+   const CRO_Index_Header* baseline_header = title.baseline ? (const CRO_Index_Header*)title.baseline->data : NULL;
+   for (uint32_t m = 0; m < cro_header->num_import_module; m++)
+   {
+      const CRO_ModuleEntry* entry = (const CRO_ModuleEntry*)(module.file.data + cro_header->offs_import_module) + m;
+      std::string exporter_name = module_string(module, entry->offs_mod_name);
+      auto found = title.module_index.find(exporter_name);
+      const CRO_Module* exporter = found != title.module_index.end() ? &title.modules[found->second] : NULL;
+      const CRO_Index_Module* old_exporter = NULL;
+      if (title.baseline)
+      {
+         auto old = title.baseline->modules.find(exporter_name);
+         old_exporter = old != title.baseline->modules.end() ? old->second : NULL;
+      }
+
+      for (uint32_t i = 0; i < entry->import_indexed_symbol_num; i++)
+      {
+         uint32_t offset = entry->import_indexed_symbol_table_offset + i * sizeof(CRO_Symbol);
+         if (offset > module.file.size - sizeof(CRO_Symbol)) break;
+
+         const CRO_Symbol* symbol = (const CRO_Symbol*)(module.file.data + offset);
+         std::string what = format("index import %s#%u (%u patches)", exporter_name.c_str(), symbol->offs_name,
+                                   module_chain_length(module, symbol->seg_offset));
+         result.imports++;
+         if (!exporter || symbol->offs_name >= module_header(*exporter)->num_index_exports)
+         {
+            result.unresolved++;
+            result.problems.push_back(format("unresolved %s%s", what.c_str(), exporter ? "" : ", module not in the title"));
+            continue;
+         }
+
+         uint32_t seg_offset = ((const CRO_Symbol*)(exporter->file.data + module_header(*exporter)->offs_index_exports))[symbol->offs_name].seg_offset;
+         if (!seg_offset_valid(*exporter, seg_offset))
+         {
+            result.unresolved++;
+            result.problems.push_back(format("unresolved %s, slot points outside the module", what.c_str()));
+         }
+         else if (old_exporter && symbol->offs_name < old_exporter->num_index_exports)
+         {
+            uint32_t old_seg_offset = baseline_header->get_index_export(title.baseline->data, old_exporter->first_index_export + symbol->offs_name);
+            check_same_target(title, exporter_name, title.exports[found->second], old_seg_offset, seg_offset, what, result);
+         }
+      }
+
+      for (uint32_t i = 0; i < entry->import_anonymous_symbol_num; i++)
+      {
+         uint32_t offset = entry->import_anonymous_symbol_table_offset + i * sizeof(CRO_Symbol);
+         if (offset > module.file.size - sizeof(CRO_Symbol)) break;
+
+         const CRO_Symbol* symbol = (const CRO_Symbol*)(module.file.data + offset);
+         std::string what = format("offset import %s %u+0x%x (%u patches)", exporter_name.c_str(), symbol->offs_name & 0xf, symbol->offs_name >> 4,
+                                   module_chain_length(module, symbol->seg_offset));
+         result.imports++;
+         if (!exporter || !seg_offset_valid(*exporter, symbol->offs_name))
+         {
+            result.unresolved++;
+            result.problems.push_back(format("unresolved %s%s", what.c_str(), exporter ? ", outside the module" : ", module not in the title"));
+         }
+         else
+            check_same_target(title, exporter_name, title.exports[found->second], symbol->offs_name, symbol->offs_name, what, result);
+      }
+   }
+}
+
+static bool load_baseline(const Mapped_File& file, Check_Baseline& baseline)
+{
+   if (!cro_index_is_valid(file.data, file.size))
+      return false;
+
+   baseline.data = file.data;
+   const CRO_Index_Header* header = (const CRO_Index_Header*)file.data;
+   baseline.names_by_offset.resize(header->num_modules);
+   parallel_for(header->num_modules, [&](size_t m)
+   {
+      const CRO_Index_Module* module = header->get_module(file.data, m);
+      for (uint32_t i = module->first_export; i < module->first_export + module->num_exports; i++)
+      {
+         const CRO_Index_Export* symbol = header->get_export(file.data, i);
+         baseline.names_by_offset[m].insert(std::make_pair(symbol->seg_offset, header->get_string(file.data, symbol->offs_name)));
+      }
+   });
+
+   for (uint32_t m = 0; m < header->num_modules; m++)
+   {
+      const CRO_Index_Module* module = header->get_module(file.data, m);
+      std::string name = header->get_string(file.data, module->offs_name);
+      baseline.modules[name] = module;
+      for (uint32_t i = module->first_export; i < module->first_export + module->num_exports; i++)
+         baseline.named_exporters.insert(std::make_pair(std::string(header->get_string(file.data, header->get_export(file.data, i)->offs_name)), name));
+   }
+   return true;
+}
+
+// Lookup tables are built once per module, then each module's imports are
+// checked by its own worker against them
+int cmd_check(int argc, char** argv)
+{
+   CRO_Module_Args args;
+   const char* baseline_path = NULL;
+   bool quiet = false;
+   bool args_ok = parse_module_args(argc, argv, false, args, [&](int i)
+   {
+      if (!strcmp(argv[i], "--baseline") && i + 1 < argc)
+      {
+         baseline_path = argv[i + 1];
+         return 2;
+      }
+      if (!strcmp(argv[i], "--quiet"))
+      {
+         quiet = true;
+         return 1;
+      }
+      return 0;
+   });
+
+   if (!args_ok)
+   {
+      printf("Usage: crotool check [--static <static.crs>] [--baseline <old.crx>] [--quiet] <input.cro>...\n");
+      printf("  --static <crs>       The static module, searched first for named imports\n");
+      printf("  --baseline <old.crx> Index of the title before patching, report imports that no\n");
+      printf("                       longer land on the export they used to\n");
+      printf("  --quiet              Only print the counts per module\n");
+      return -1;
+   }
+
+   std::vector<CRO_Module> modules;
+   if (!load_modules(args.placements, args.static_path, 0, modules))
+   {
+      unload_modules(modules);
+      return -1;
+   }
+
+   Mapped_File baseline_file = {};
+   Check_Baseline baseline;
+   if (baseline_path && (!map_file(baseline_path, baseline_file) || !load_baseline(baseline_file, baseline)))
+   {
+      printf("%s: not a valid CRO index\n", baseline_path);
+      if (baseline_file.data)
+         unmap_file(baseline_file);
+      unload_modules(modules);
+      return -1;
+   }
+
+   Check_Title title = {modules, std::vector<Check_Exports>(modules.size()), {}, {}, baseline_path ? &baseline : NULL};
+   parallel_for(modules.size(), [&](size_t m)
+   {
+      const CRO_Header* cro_header = module_header(modules[m]);
+      Check_Exports& exports = title.exports[m];
+      for (uint32_t i = 0; i < cro_header->num_symbol_exports; i++)
+      {
+         const CRO_Symbol* symbol = (const CRO_Symbol*)(modules[m].file.data + cro_header->offs_symbol_exports) + i;
+         std::string name = module_string(modules[m], symbol->offs_name);
+         exports.by_name.insert(std::make_pair(name, symbol->seg_offset));
+         exports.by_offset.insert(std::make_pair(symbol->seg_offset, name));
+      }
+   });
+
+   for (size_t m = 0; m < modules.size(); m++)
+   {
+      if (!title.module_index.insert(std::make_pair(modules[m].name, (int)m)).second)
+         printf("Warning: module %s is given twice, imports use the first\n", modules[m].name.c_str());
+      for (const auto& exp : title.exports[m].by_name)
+         title.named_exporters.insert(std::make_pair(exp.first, (int)m));
+   }
+
+   std::vector<Check_Result> results(modules.size());
+   parallel_for(modules.size(), [&](size_t m)
+   {
+      check_module(title, m, results[m]);
+   });
+
+   size_t imports = 0, unresolved = 0, changed = 0;
+   for (size_t m = 0; m < modules.size(); m++)
+   {
+      const Check_Result& result = results[m];
+      imports += result.imports;
+      unresolved += result.unresolved;
+      changed += result.changed;
+      if (result.problems.empty()) continue;
+
+      printf("%s: %zu imports, %zu unresolved, %zu changed\n", modules[m].name.c_str(), result.imports, result.unresolved, result.changed);
+      for (size_t i = 0; i < result.problems.size() && !quiet; i++)
+         printf("   %s\n", result.problems[i].c_str());
+   }
+   printf("Checked %zu imports in %zu modules, %zu unresolved, %zu changed\n", imports, modules.size(), unresolved, changed);
+
+   if (baseline_file.data)
+      unmap_file(baseline_file);
+   unload_modules(modules);
+   return unresolved || changed ? -1 : 0;
+}
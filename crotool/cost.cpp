@@ -0,0 +1,337 @@
+#include <algorithm>
+#include <cstring>
+#include <set>
+#include <unordered_map>
+
+#include "crotool.h"
+
+#define COST_PAGE_SIZE (0x1000)
+
+// Work charged to loading one module, including what it does to modules
+// loaded before it when it resolves their imports
+typedef struct
+{
+   size_t named_imports;
+   size_t lookups;
+   size_t node_visits;
+   size_t string_compares;
+   size_t relocs;
+   size_t pages;
+   size_t bytes;
+   size_t padding;
+} Load_Cost;
+
+// Loader state of a module: which imports are still waiting for an exporter
+typedef struct
+{
+   std::vector<bool> named_resolved;
+   std::vector<bool> module_resolved;
+} Load_State;
+
+typedef struct
+{
+   const std::vector<CRO_Module>& modules;
+   std::vector<Load_State> states;
+   Load_Cost cost;
+   std::set<uint32_t> pages;
+} Load_Sim;
+
+static void touch(Load_Sim& sim, uint32_t addr, uint32_t size = 1)
+{
+   for (uint32_t page = addr / COST_PAGE_SIZE; page <= (addr + size - 1) / COST_PAGE_SIZE; page++)
+      sim.pages.insert(page);
+}
+
+// Tables are read where the CRO was loaded
+static void touch_table(Load_Sim& sim, const CRO_Module& module, uint32_t offset, uint32_t size)
+{
+   if (size)
+      touch(sim, module.placement.base + offset, size);
+}
+
+// Writes every patch of a chain, returns how many there were
+static size_t apply_chain(Load_Sim& sim, const CRO_Module& module, uint32_t chain_offset)
+{
+   if (!chain_offset) return 0;
+
+   size_t count = 0;
+   for (uint32_t offset = chain_offset; offset <= module.file.size - sizeof(CRO_Relocation); offset += sizeof(CRO_Relocation))
+   {
+      const CRO_Relocation* reloc = (const CRO_Relocation*)(module.file.data + offset);
+      touch_table(sim, module, offset, sizeof(CRO_Relocation));
+      if ((reloc->seg_offset & 0xf) < module_header(module)->num_segments)
+         touch(sim, module_segment_address(module, reloc->seg_offset & 0xf) + (reloc->seg_offset >> 4), 4);
+      count++;
+      if (reloc->last_entry) break;
+   }
+   sim.cost.relocs += count;
+   return count;
+}
+
+// Walks the export trie the way the loader does: test one bit per node
+// until an end branch, then one string compare against the export it names
+static bool lookup_export(Load_Sim& sim, const CRO_Module& module, const std::string& name)
+{
+   const CRO_Header* cro_header = module_header(module);
+   if (!cro_header->num_export_tree)
+      return false;
+
+   const CRO_ExportTreeEntry* tree = (const CRO_ExportTreeEntry*)(module.file.data + cro_header->offs_export_tree);
+   CRO_ExportTreeChild next = tree[0].left;
+   sim.cost.lookups++;
+   sim.cost.node_visits++;
+   touch_table(sim, module, cro_header->offs_export_tree, sizeof(CRO_ExportTreeEntry));
+   for (uint32_t depth = 0; depth <= cro_header->num_export_tree; depth++)
+   {
+      if (next.next_index >= cro_header->num_export_tree)
+         return false;
+
+      const CRO_ExportTreeEntry& entry = tree[next.next_index];
+      sim.cost.node_visits++;
+      touch_table(sim, module, cro_header->offs_export_tree + next.next_index * sizeof(CRO_ExportTreeEntry), sizeof(CRO_ExportTreeEntry));
+      if (next.is_end)
+      {
+         if (entry.export_index >= cro_header->num_symbol_exports)
+            return false;
+
+         const CRO_Symbol* symbol = (const CRO_Symbol*)(module.file.data + cro_header->offs_symbol_exports) + entry.export_index;
+         std::string export_name = module_string(module, symbol->offs_name);
+         sim.cost.string_compares++;
+         touch_table(sim, module, cro_header->offs_symbol_exports + entry.export_index * sizeof(CRO_Symbol), sizeof(CRO_Symbol));
+         touch_table(sim, module, symbol->offs_name, export_name.size() + 1);
+         return export_name == name;
+      }
+
+      bool bit = entry.test_byte < name.size() && ((name[entry.test_byte] >> entry.test_bit) & 1);
+      next = bit ? entry.right : entry.left;
+   }
+   return false;
+}
+
+static const CRO_ModuleEntry* module_entry(const CRO_Module& module, uint32_t m)
+{
+   return (const CRO_ModuleEntry*)(module.file.data + module_header(module)->offs_import_module) + m;
+}
+
+// Resolves one module's index and offset imports of an exporter, each is a
+// direct table read on the exporter's side
+static void apply_module_import(Load_Sim& sim, const CRO_Module& importer, const CRO_Module& exporter, uint32_t m)
+{
+   const CRO_ModuleEntry* entry = module_entry(importer, m);
+   const CRO_Header* exporter_header = module_header(exporter);
+   uint32_t tables[2] = {entry->import_indexed_symbol_table_offset, entry->import_anonymous_symbol_table_offset};
+   uint32_t counts[2] = {entry->import_indexed_symbol_num, entry->import_anonymous_symbol_num};
+   for (int t = 0; t < 2; t++)
+   {
+      for (uint32_t i = 0; i < counts[t]; i++)
+      {
+         uint32_t offset = tables[t] + i * sizeof(CRO_Symbol);
+         if (offset > importer.file.size - sizeof(CRO_Symbol)) break;
+
+         const CRO_Symbol* symbol = (const CRO_Symbol*)(importer.file.data + offset);
+         touch_table(sim, importer, offset, sizeof(CRO_Symbol));
+         if (t == 0)
+            touch_table(sim, exporter, exporter_header->offs_index_exports + symbol->offs_name * sizeof(CRO_Symbol), sizeof(CRO_Symbol));
+         apply_chain(sim, importer, symbol->seg_offset);
+      }
+   }
+}
+
+// Parts of the file the loader reads: header, tables and segment contents.
+// Whatever the module occupies outside of them is alignment padding.
+static size_t used_bytes(const CRO_Module& module)
+{
+   const CRO_Header* h = module_header(module);
+   const CRO_Segment* segments = module_segments(module);
+   std::vector<std::pair<uint64_t, uint64_t>> ranges =
+   {
+      {0, sizeof(CRO_Header)},
+      {h->offs_mod_name, module_string(module, h->offs_mod_name).size() + 1},
+      {h->offs_segments, h->num_segments * (uint64_t)sizeof(CRO_Segment)},
+      {h->offs_symbol_exports, h->num_symbol_exports * (uint64_t)sizeof(CRO_Symbol)},
+      {h->offs_index_exports, h->num_index_exports * (uint64_t)sizeof(CRO_Symbol)},
+      {h->offs_export_strtab, h->size_export_strtab},
+      {h->offs_export_tree, h->num_export_tree * (uint64_t)sizeof(CRO_ExportTreeEntry)},
+      {h->offs_import_module, h->num_import_module * (uint64_t)sizeof(CRO_ModuleEntry)},
+      {h->offs_import_patches, h->num_import_patches * (uint64_t)sizeof(CRO_Relocation)},
+      {h->offs_symbol_imports, h->num_symbol_imports * (uint64_t)sizeof(CRO_Symbol)},
+      {h->offs_index_imports, h->num_index_imports * (uint64_t)sizeof(CRO_Symbol)},
+      {h->offs_offset_imports, h->num_offset_imports * (uint64_t)sizeof(CRO_Symbol)},
+      {h->offs_import_strtab, h->size_import_strtab},
+      {h->offs_offset_exports, h->num_offset_exports * (uint64_t)sizeof(CRO_Symbol)},
+      {h->offs_static_relocations, h->num_static_relocations * (uint64_t)sizeof(CRO_Relocation)},
+      {h->offs_unk, h->size_unk},
+   };
+   for (uint32_t i = 0; i < h->num_segments && !module.is_static; i++)
+   {
+      if (segments[i].type != SEG_BSS)
+         ranges.push_back(std::make_pair((uint64_t)segments[i].offset, (uint64_t)segments[i].size));
+   }
+
+   for (auto& range : ranges)
+   {
+      range.second = std::min(range.first + range.second, (uint64_t)module.file.size);
+      range.first = std::min(range.first, range.second);
+   }
+   std::sort(ranges.begin(), ranges.end());
+
+   size_t used = 0;
+   uint64_t covered = 0;
+   for (const auto& range : ranges)
+   {
+      if (range.second <= covered) continue;
+      used += range.second - std::max(range.first, covered);
+      covered = range.second;
+   }
+   return used;
+}
+
+static void load_module(Load_Sim& sim, size_t index)
+{
+   const CRO_Module& module = sim.modules[index];
+   const CRO_Header* cro_header = module_header(module);
+   Load_State& state = sim.states[index];
+   state.named_resolved.assign(cro_header->num_symbol_imports, false);
+   state.module_resolved.assign(cro_header->num_import_module, false);
+
+   sim.cost.bytes = module.file.size;
+   sim.cost.padding = module.file.size - used_bytes(module);
+   touch_table(sim, module, 0, sizeof(CRO_Header));
+   touch_table(sim, module, cro_header->offs_segments, cro_header->num_segments * sizeof(CRO_Segment));
+
+   // Every import patch is first pointed at the unresolved stub
+   sim.cost.relocs += cro_header->num_import_patches;
+   touch_table(sim, module, cro_header->offs_import_patches, cro_header->num_import_patches * sizeof(CRO_Relocation));
+
+   for (uint32_t i = 0; i < cro_header->num_static_relocations; i++)
+   {
+      const CRO_Relocation* reloc = (const CRO_Relocation*)(module.file.data + cro_header->offs_static_relocations) + i;
+      touch_table(sim, module, cro_header->offs_static_relocations + i * sizeof(CRO_Relocation), sizeof(CRO_Relocation));
+      if ((reloc->seg_offset & 0xf) < cro_header->num_segments)
+         touch(sim, module_segment_address(module, reloc->seg_offset & 0xf) + (reloc->seg_offset >> 4), 4);
+   }
+   sim.cost.relocs += cro_header->num_static_relocations;
+
+   // Own named imports search the loaded modules in load order
+   sim.cost.named_imports = cro_header->num_symbol_imports;
+   for (uint32_t i = 0; i < cro_header->num_symbol_imports; i++)
+   {
+      const CRO_Symbol* symbol = (const CRO_Symbol*)(module.file.data + cro_header->offs_symbol_imports) + i;
+      std::string name = module_string(module, symbol->offs_name);
+      touch_table(sim, module, cro_header->offs_symbol_imports + i * sizeof(CRO_Symbol), sizeof(CRO_Symbol));
+      touch_table(sim, module, symbol->offs_name, name.size() + 1);
+      for (size_t e = 0; e < index && !state.named_resolved[i]; e++)
+      {
+         if (lookup_export(sim, sim.modules[e], name))
+         {
+            apply_chain(sim, module, symbol->seg_offset);
+            state.named_resolved[i] = true;
+         }
+      }
+   }
+
+   for (uint32_t m = 0; m < cro_header->num_import_module; m++)
+   {
+      std::string name = module_string(module, module_entry(module, m)->offs_mod_name);
+      for (size_t e = 0; e < index && !state.module_resolved[m]; e++)
+      {
+         if (sim.modules[e].name == name)
+         {
+            apply_module_import(sim, module, sim.modules[e], m);
+            state.module_resolved[m] = true;
+         }
+      }
+   }
+
+   // Then the modules already loaded get a look at the new exports
+   for (size_t e = 0; e < index; e++)
+   {
+      const CRO_Module& earlier = sim.modules[e];
+      const CRO_Header* earlier_header = module_header(earlier);
+      Load_State& earlier_state = sim.states[e];
+      for (uint32_t i = 0; i < earlier_header->num_symbol_imports; i++)
+      {
+         if (earlier_state.named_resolved[i]) continue;
+
+         const CRO_Symbol* symbol = (const CRO_Symbol*)(earlier.file.data + earlier_header->offs_symbol_imports) + i;
+         std::string name = module_string(earlier, symbol->offs_name);
+         touch_table(sim, earlier, earlier_header->offs_symbol_imports + i * sizeof(CRO_Symbol), sizeof(CRO_Symbol));
+         touch_table(sim, earlier, symbol->offs_name, name.size() + 1);
+         if (lookup_export(sim, module, name))
+         {
+            apply_chain(sim, earlier, symbol->seg_offset);
+            earlier_state.named_resolved[i] = true;
+         }
+      }
+
+      for (uint32_t m = 0; m < earlier_header->num_import_module; m++)
+      {
+         if (earlier_state.module_resolved[m] || module_string(earlier, module_entry(earlier, m)->offs_mod_name) != module.name) continue;
+
+         apply_module_import(sim, earlier, module, m);
+         earlier_state.module_resolved[m] = true;
+      }
+   }
+
+   sim.cost.pages = sim.pages.size();
+}
+
+static void print_cost(const char* name, const Load_Cost& cost)
+{
+   printf("%-24s %8zu %8zu %10zu %8.2f %10zu %10zu %8zu %10zu %10zu\n", name, cost.named_imports, cost.lookups, cost.node_visits,
+          cost.lookups ? (double)cost.node_visits / cost.lookups : 0.0, cost.string_compares, cost.relocs,
+          cost.pages, cost.bytes, cost.padding);
+}
+
+// Modules are loaded in the order given, the static module first. Each
+// one's row holds what the loader does while loading it, resolving earlier
+// modules' imports against it included.
+int cmd_cost(int argc, char** argv)
+{
+   CRO_Module_Args args;
+   if (!parse_module_args(argc, argv, false, args, [](int) { return 0; }))
+   {
+      printf("Usage: crotool cost [--static <static.crs>] <input.cro>[@<base>[,<data>]]...\n");
+      printf("  --static <crs>  The static module, loaded first\n");
+      printf("  Modules load in the order given; the table shows the loader's work for each,\n");
+      printf("  per is trie nodes visited per export lookup, lookups include earlier modules' imports,\n");
+      printf("  pages are 0x%x bytes and padding is file bytes outside the header, tables and segments\n", COST_PAGE_SIZE);
+      return -1;
+   }
+
+   std::vector<CRO_Module> modules;
+   if (!load_modules(args.placements, args.static_path, 0, modules))
+   {
+      unload_modules(modules);
+      return -1;
+   }
+
+   Load_Sim sim = {modules, std::vector<Load_State>(modules.size()), Load_Cost(), std::set<uint32_t>()};
+   Load_Cost total = {};
+   printf("%-24s %8s %8s %10s %8s %10s %10s %8s %10s %10s\n", "module", "imports", "lookups", "visits", "per", "compares", "relocs", "pages", "bytes", "padding");
+   for (size_t i = 0; i < modules.size(); i++)
+   {
+      sim.cost = Load_Cost();
+      sim.pages.clear();
+      load_module(sim, i);
+      print_cost(modules[i].name.c_str(), sim.cost);
+
+      total.named_imports += sim.cost.named_imports;
+      total.lookups += sim.cost.lookups;
+      total.node_visits += sim.cost.node_visits;
+      total.string_compares += sim.cost.string_compares;
+      total.relocs += sim.cost.relocs;
+      total.pages += sim.cost.pages;
+      total.bytes += sim.cost.bytes;
+      total.padding += sim.cost.padding;
+   }
+   print_cost("(title)", total);
+
+   size_t unresolved = 0;
+   for (size_t i = 0; i < modules.size(); i++)
+      unresolved += std::count(sim.states[i].named_resolved.begin(), sim.states[i].named_resolved.end(), false);
+   printf("%zu named imports left unresolved\n", unresolved);
+
+   unload_modules(modules);
+   return 0;
+}
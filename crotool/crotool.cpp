@@ -0,0 +1,307 @@
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "crotool.h"
+
+static const CROTool_Command commands[] =
+{
+   {"hash", cmd_hash, "[--verify] <input.cro>...  Recompute (or check) the header hash table"},
+   {"crr", cmd_crr, "[--base <in.crr>] [--update] [--text] <output.crr> <input.cro>...  Build the CRR hash list"},
+   {"symbolize", cmd_symbolize, "[--static <static.crs> <code.bin>] [--addrs <file>] <input.cro>[@<base>[,<data>]]...  Map addresses to module, segment and export"},
+   {"link", cmd_link, "[--static <static.crs> <code.bin>] [--out <dir>] <input.cro>[@<base>[,<data>]]...  Apply imports and relocations into load images"},
+   {"cost", cmd_cost, "[--static <static.crs>] <input.cro>[@<base>[,<data>]]...  Estimate the loader's work per module"},
+   {"index", cmd_index, "<output.crx> [--list <cro_list.txt>] <input.cro>...  Write the cross-reference index"},
+   {"check", cmd_check, "[--static <static.crs>] [--baseline <old.crx>] [--quiet] <input.cro>...  Check every import of a title resolves, and still lands where it did"},
+};
+
+bool load_file(const char* path, std::vector<char>& data)
+{
+   FILE* file = fopen(path, "rb");
+   if (!file)
+      return false;
+   
+   fseek(file, 0, SEEK_END);
+   data.resize(ftell(file));
+   fseek(file, 0, SEEK_SET);
+   bool read = fread(data.data(), sizeof(uint8_t), data.size(), file) == data.size();
+   fclose(file);
+   return read;
+}
+
+bool save_file(const char* path, const void* data, size_t size)
+{
+   FILE* file = fopen(path, "wb");
+   if (!file)
+      return false;
+   
+   bool written = fwrite(data, sizeof(uint8_t), size, file) == size;
+   fclose(file);
+   return written;
+}
+
+bool patch_file(const char* path, size_t offset, const void* data, size_t size)
+{
+   FILE* file = fopen(path, "r+b");
+   if (!file)
+      return false;
+   
+   bool written = fseek(file, offset, SEEK_SET) == 0 && fwrite(data, sizeof(uint8_t), size, file) == size;
+   fclose(file);
+   return written;
+}
+
+bool map_file(const char* path, Mapped_File& file)
+{
+   file.data = NULL;
+   file.size = 0;
+   file.mapped = false;
+   
+#ifndef _WIN32
+   int fd = open(path, O_RDONLY);
+   if (fd < 0)
+      return false;
+   
+   struct stat file_stat;
+   if (fstat(fd, &file_stat) == 0 && file_stat.st_size > 0)
+   {
+      void* mapping = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (mapping != MAP_FAILED)
+      {
+         file.data = (const char*)mapping;
+         file.size = file_stat.st_size;
+         file.mapped = true;
+      }
+   }
+   close(fd);
+   
+   if (file.mapped)
+      return true;
+#endif
+   
+   std::vector<char> data;
+   if (!load_file(path, data))
+      return false;
+   
+   char* copy = (char*)malloc(data.size());
+   memcpy(copy, data.data(), data.size());
+   file.data = copy;
+   file.size = data.size();
+   return true;
+}
+
+void unmap_file(Mapped_File& file)
+{
+#ifndef _WIN32
+   if (file.mapped)
+      munmap((void*)file.data, file.size);
+   else
+#endif
+      free((void*)file.data);
+   
+   file.data = NULL;
+   file.size = 0;
+}
+
+void parallel_for(size_t count, const std::function<void(size_t)>& func)
+{
+   size_t num_workers = std::thread::hardware_concurrency();
+   if (num_workers == 0) num_workers = 1;
+   if (num_workers > count) num_workers = count;
+   
+   std::atomic<size_t> next(0);
+   auto worker = [&]()
+   {
+      for (size_t i = next++; i < count; i = next++)
+         func(i);
+   };
+   
+   std::vector<std::thread> workers;
+   for (size_t i = 1; i < num_workers; i++)
+      workers.push_back(std::thread(worker));
+   worker();
+   
+   for (auto& thread : workers)
+      thread.join();
+}
+
+bool parse_placement(char* arg, CRO_Placement& placement)
+{
+   placement.path = arg;
+   placement.base = 0;
+   placement.data_base = 0;
+   placement.has_base = false;
+   placement.has_data_base = false;
+   
+   char* at = strrchr(arg, '@');
+   if (!at)
+      return true;
+   
+   *at = 0;
+   char* end;
+   placement.base = strtoul(at + 1, &end, 16);
+   placement.has_base = end != at + 1;
+   if (*end == ',')
+   {
+      char* data = end + 1;
+      placement.data_base = strtoul(data, &end, 16);
+      placement.has_data_base = end != data;
+   }
+   return placement.has_base && *end == 0;
+}
+
+bool parse_module_args(int argc, char** argv, bool with_code, CRO_Module_Args& args, const std::function<int(int i)>& own_flag)
+{
+   args.static_path = NULL;
+   args.code_path = NULL;
+   args.placements.clear();
+   
+   bool bad_args = false;
+   for (int i = 0; i < argc; i++)
+   {
+      int taken = own_flag(i);
+      if (taken)
+         i += taken - 1;
+      else if (!strcmp(argv[i], "--static") && i + (with_code ? 2 : 1) < argc)
+      {
+         args.static_path = argv[++i];
+         if (with_code)
+            args.code_path = argv[++i];
+      }
+      else
+      {
+         CRO_Placement placement;
+         bad_args |= !parse_placement(argv[i], placement);
+         args.placements.push_back(placement);
+      }
+   }
+   return !bad_args && (!args.placements.empty() || args.static_path);
+}
+
+static bool cro_table_fits(size_t cro_size, uint32_t offset, uint32_t count, size_t entry_size)
+{
+   return offset <= cro_size && count <= (cro_size - offset) / entry_size;
+}
+
+bool cro_is_valid(const char* cro_data, size_t cro_size)
+{
+   if (cro_size < sizeof(CRO_Header))
+      return false;
+   
+   const CRO_Header* cro_header = (const CRO_Header*)cro_data;
+   return cro_header->magic == MAGIC_CRO0
+       && cro_header->offs_mod_name < cro_size
+       && cro_table_fits(cro_size, cro_header->offs_segments, cro_header->num_segments, sizeof(CRO_Segment))
+       && cro_table_fits(cro_size, cro_header->offs_symbol_exports, cro_header->num_symbol_exports, sizeof(CRO_Symbol))
+       && cro_table_fits(cro_size, cro_header->offs_index_exports, cro_header->num_index_exports, sizeof(CRO_Symbol))
+       && cro_table_fits(cro_size, cro_header->offs_export_tree, cro_header->num_export_tree, sizeof(CRO_ExportTreeEntry))
+       && cro_table_fits(cro_size, cro_header->offs_import_module, cro_header->num_import_module, sizeof(CRO_ModuleEntry))
+       && cro_table_fits(cro_size, cro_header->offs_import_patches, cro_header->num_import_patches, sizeof(CRO_Relocation))
+       && cro_table_fits(cro_size, cro_header->offs_symbol_imports, cro_header->num_symbol_imports, sizeof(CRO_Symbol))
+       && cro_table_fits(cro_size, cro_header->offs_static_relocations, cro_header->num_static_relocations, sizeof(CRO_Relocation));
+}
+
+uint32_t place_module(CRO_Placement& placement, const CRO_Header* cro_header, uint32_t base)
+{
+   if (!placement.has_base)
+   {
+      placement.base = base;
+      placement.has_base = true;
+   }
+   
+   uint32_t end = placement.base + cro_header->size_file;
+   return (end + 0xFFF) & ~0xFFF;
+}
+
+// Same layout cro2elf gives the segments, bss right after data
+uint32_t cro_segment_address(const CRO_Placement& placement, const CRO_Header* cro_header, const CRO_Segment* segments, int segment)
+{
+   const CRO_Segment& seg = segments[segment];
+   if (seg.type == SEG_DATA && placement.has_data_base)
+      return placement.data_base + seg.offset - cro_header->offs_data;
+   if (seg.type == SEG_BSS)
+   {
+      for (uint32_t i = 0; i < cro_header->num_segments; i++)
+      {
+         if (segments[i].type == SEG_DATA)
+            return cro_segment_address(placement, cro_header, segments, i) + segments[i].size;
+      }
+   }
+   return placement.base + seg.offset;
+}
+
+bool load_modules(const std::vector<CRO_Placement>& placements, const char* static_path, uint32_t code_size, std::vector<CRO_Module>& modules)
+{
+   std::vector<CRO_Placement> all = placements;
+   if (static_path)
+   {
+      CRO_Placement placement = {static_path, 0, 0, true, false};
+      all.insert(all.begin(), placement);
+   }
+   
+   modules.resize(all.size());
+   uint32_t next_base = (STATIC_BASE + code_size + 0xFFF) & ~0xFFF;
+   for (size_t i = 0; i < modules.size(); i++)
+   {
+      CRO_Module& module = modules[i];
+      module.placement = all[i];
+      module.is_static = static_path && i == 0;
+      if (!map_file(module.placement.path, module.file))
+      {
+         printf("Failed to open file %s! Exiting...\n", module.placement.path);
+         modules.resize(i);
+         return false;
+      }
+      if (!cro_is_valid(module.file.data, module.file.size))
+      {
+         printf("%s: not a valid CRO\n", module.placement.path);
+         modules.resize(i + 1);
+         return false;
+      }
+      
+      module.name = module_string(module, module_header(module)->offs_mod_name);
+      if (!module.is_static)
+         next_base = place_module(module.placement, module_header(module), next_base);
+   }
+   return true;
+}
+
+void unload_modules(std::vector<CRO_Module>& modules)
+{
+   for (auto& module : modules)
+      unmap_file(module.file);
+   modules.clear();
+}
+
+void print_usage(char* name)
+{
+   printf("Usage: %s <command> [args]\n", name);
+   for (const auto& command : commands)
+      printf("  %s %s\n", command.name, command.usage);
+}
+
+int main(int argc, char **argv)
+{
+   if (argc < 2)
+   {
+      print_usage(argv[0]);
+      return -1;
+   }
+   
+   for (const auto& command : commands)
+   {
+      if (!strcmp(argv[1], command.name))
+         return command.run(argc - 2, argv + 2);
+   }
+   
+   print_usage(argv[0]);
+   return -1;
+}
@@ -0,0 +1,137 @@
+#ifndef CROTOOL_H
+#define CROTOOL_H
+
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "cro.h"
+
+typedef struct
+{
+   const char* name;
+   int (*run)(int argc, char** argv);
+   const char* usage;
+} CROTool_Command;
+
+typedef struct
+{
+   const char* data;
+   size_t size;
+   bool mapped;
+} Mapped_File;
+
+bool load_file(const char* path, std::vector<char>& data);
+bool save_file(const char* path, const void* data, size_t size);
+bool patch_file(const char* path, size_t offset, const void* data, size_t size);
+
+// Maps a file read-only, falling back to reading it where mmap isn't available
+bool map_file(const char* path, Mapped_File& file);
+void unmap_file(Mapped_File& file);
+
+// Runs func(0..count-1) over a pool of worker threads
+void parallel_for(size_t count, const std::function<void(size_t)>& func);
+
+// Where the loader puts a module. Text and rodata stay in the CRO image at
+// base, data and bss go to the buffer at data_base. Static modules already
+// carry absolute segment offsets, so their base is 0.
+typedef struct
+{
+   const char* path;
+   uint32_t base;
+   uint32_t data_base;
+   bool has_base;
+   bool has_data_base;
+} CRO_Placement;
+
+// A mapped, placed module. The static module's segments live in code.bin.
+typedef struct
+{
+   CRO_Placement placement;
+   Mapped_File file;
+   std::string name;
+   bool is_static;
+} CRO_Module;
+
+#define STATIC_BASE (0x100000)
+
+// "<input.cro>[@<base>[,<data_base>]]", the path is cut out of arg in place
+bool parse_placement(char* arg, CRO_Placement& placement);
+
+// The module set the symbolize, link, cost and check commands work on
+typedef struct
+{
+   const char* static_path;
+   const char* code_path; // only with with_code
+   std::vector<CRO_Placement> placements;
+} CRO_Module_Args;
+
+// Parses "--static <static.crs>" (followed by <code.bin> when with_code) and
+// the placements. own_flag(i) handles the command's flag at argv[i] and
+// returns how many arguments it took, 0 when it isn't one. False when a
+// placement doesn't parse or no module was given, the command prints usage.
+bool parse_module_args(int argc, char** argv, bool with_code, CRO_Module_Args& args, const std::function<int(int i)>& own_flag);
+
+// Checks the header and that the segment, export and import tables lie in the file
+bool cro_is_valid(const char* cro_data, size_t cro_size);
+
+// Gives unplaced modules page aligned bases, one after the other from base
+uint32_t place_module(CRO_Placement& placement, const CRO_Header* cro_header, uint32_t base);
+
+// Runtime address of a segment of a placed module
+uint32_t cro_segment_address(const CRO_Placement& placement, const CRO_Header* cro_header, const CRO_Segment* segments, int segment);
+
+// Maps and checks every module, the static one first when there is one, and
+// places the others after code.bin. Prints what failed.
+bool load_modules(const std::vector<CRO_Placement>& placements, const char* static_path, uint32_t code_size, std::vector<CRO_Module>& modules);
+void unload_modules(std::vector<CRO_Module>& modules);
+
+inline const CRO_Header* module_header(const CRO_Module& module)
+{
+   return (const CRO_Header*)module.file.data;
+}
+
+inline const CRO_Segment* module_segments(const CRO_Module& module)
+{
+   return (const CRO_Segment*)(module.file.data + module_header(module)->offs_segments);
+}
+
+inline uint32_t module_segment_address(const CRO_Module& module, int segment)
+{
+   return cro_segment_address(module.placement, module_header(module), module_segments(module), segment);
+}
+
+// NUL terminated string at offset, cut at the end of the file
+inline std::string module_string(const CRO_Module& module, uint32_t offset)
+{
+   if (offset >= module.file.size)
+      return std::string();
+   const char* str = module.file.data + offset;
+   return std::string(str, strnlen(str, module.file.size - offset));
+}
+
+// Number of patches in the import chain at chain_offset, 0 for no chain
+inline uint32_t module_chain_length(const CRO_Module& module, uint32_t chain_offset)
+{
+   if (!chain_offset) return 0;
+
+   uint32_t count = 0;
+   for (uint32_t offset = chain_offset; offset <= module.file.size - sizeof(CRO_Relocation); offset += sizeof(CRO_Relocation))
+   {
+      count++;
+      if (((const CRO_Relocation*)(module.file.data + offset))->last_entry) break;
+   }
+   return count;
+}
+
+int cmd_hash(int argc, char** argv);
+int cmd_crr(int argc, char** argv);
+int cmd_symbolize(int argc, char** argv);
+int cmd_link(int argc, char** argv);
+int cmd_cost(int argc, char** argv);
+int cmd_index(int argc, char** argv);
+int cmd_check(int argc, char** argv);
+
+#endif // CROTOOL_H
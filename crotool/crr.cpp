@@ -0,0 +1,151 @@
+#include <algorithm>
+#include <array>
+#include <cstring>
+
+#include "crotool.h"
+#include "cro_hash.h"
+
+typedef std::array<uint8_t, CRO_HASH_SIZE> CRR_Hash;
+
+#define CRR_HASHES_OFFSET (sizeof(CRR_Header))
+static_assert(sizeof(CRR_Header) == 0x360, "CRR hashes start at 0x360");
+
+// The CRR lists SHA-256(CRO_Header::hash_table) of every CRO the title may
+// load, sorted so the loader can binary search it. Each CRO is read once:
+// its region hashes give both the up-to-date hash table and its CRR entry.
+int cmd_crr(int argc, char** argv)
+{
+   const char* base_path = NULL;
+   bool update = false;
+   bool text = false;
+   std::vector<const char*> paths;
+   for (int i = 0; i < argc; i++)
+   {
+      if (!strcmp(argv[i], "--base") && i + 1 < argc)
+         base_path = argv[++i];
+      else if (!strcmp(argv[i], "--update"))
+         update = true;
+      else if (!strcmp(argv[i], "--text"))
+         text = true;
+      else
+         paths.push_back(argv[i]);
+   }
+
+   if (paths.size() < 2)
+   {
+      printf("Usage: crotool crr [--base <in.crr>] [--update] [--text] <output.crr> <input.cro>...\n");
+      printf("  --base <in.crr>  Keep the header and signatures of an existing CRR\n");
+      printf("  --update         Also write the recomputed hash table back into stale CROs\n");
+      printf("  --text           Write the sorted hashes as hex lines instead of a CRR\n");
+      return -1;
+   }
+
+   const char* output_path = paths[0];
+   paths.erase(paths.begin());
+
+   enum { CRR_OK, CRR_STALE, CRR_UPDATED, CRR_FAILED };
+   std::vector<int> results(paths.size());
+   std::vector<CRR_Hash> hashes(paths.size());
+   parallel_for(paths.size(), [&](size_t i)
+   {
+      Mapped_File cro_file;
+      uint8_t hash_table[CRO_HASH_REGIONS * CRO_HASH_SIZE];
+      if (!map_file(paths[i], cro_file))
+      {
+         results[i] = CRR_FAILED;
+         return;
+      }
+
+      if (!cro_hash_regions(cro_file.data, cro_file.size, hash_table, false))
+         results[i] = CRR_FAILED;
+      else if (!memcmp(cro_file.data, hash_table, sizeof(hash_table)))
+         results[i] = CRR_OK;
+      else if (update)
+         results[i] = patch_file(paths[i], 0, hash_table, sizeof(hash_table)) ? CRR_UPDATED : CRR_FAILED;
+      else
+         results[i] = CRR_STALE;
+
+      sha256(hash_table, sizeof(hash_table), hashes[i].data());
+      unmap_file(cro_file);
+   });
+
+   int errors = 0;
+   for (size_t i = 0; i < paths.size(); i++)
+   {
+      if (results[i] == CRR_FAILED)
+      {
+         printf("%s: not a valid CRO\n", paths[i]);
+         errors++;
+      }
+      else if (results[i] == CRR_STALE)
+         printf("%s: hash table is stale, the loader will reject it (run with --update)\n", paths[i]);
+      else if (results[i] == CRR_UPDATED)
+         printf("%s: hash table updated\n", paths[i]);
+   }
+
+   if (errors)
+      return -1;
+
+   std::sort(hashes.begin(), hashes.end());
+   hashes.erase(std::unique(hashes.begin(), hashes.end()), hashes.end());
+
+   if (text)
+   {
+      std::string lines;
+      for (const auto& hash : hashes)
+      {
+         char hex[CRO_HASH_SIZE * 2 + 2];
+         for (int i = 0; i < CRO_HASH_SIZE; i++)
+            snprintf(hex + i * 2, 3, "%02x", hash[i]);
+         lines += std::string(hex) + "\n";
+      }
+
+      if (!save_file(output_path, lines.data(), lines.size()))
+      {
+         printf("Failed to open file %s for writing! Exiting...\n", output_path);
+         return -1;
+      }
+      printf("Wrote %zu hashes\n", hashes.size());
+      return 0;
+   }
+
+   CRR_Header crr_header;
+   memset(&crr_header, 0, sizeof(crr_header));
+   if (base_path)
+   {
+      std::vector<char> base_data;
+      if (!load_file(base_path, base_data) || base_data.size() < sizeof(CRR_Header) || ((CRR_Header*)base_data.data())->magic != MAGIC_CRR0)
+      {
+         printf("Failed to load CRR %s! Exiting...\n", base_path);
+         return -1;
+      }
+      memcpy(&crr_header, base_data.data(), sizeof(crr_header));
+   }
+
+   // The loader maps the CRR, so it is padded to whole pages
+   size_t hashes_size = hashes.size() * CRO_HASH_SIZE;
+   size_t crr_size = (CRR_HASHES_OFFSET + hashes_size + 0xFFF) & ~0xFFF;
+
+   crr_header.magic = MAGIC_CRR0;
+   crr_header.offs_next = 0;
+   crr_header.offs_prev = 0;
+   crr_header.size_file = crr_size;
+   crr_header.offs_hashes = CRR_HASHES_OFFSET;
+   crr_header.num_hashes = hashes.size();
+   crr_header.offs_plain = CRR_HASHES_OFFSET + hashes_size;
+   crr_header.size_plain = 0;
+
+   std::vector<uint8_t> crr_data(crr_size, 0);
+   memcpy(crr_data.data(), &crr_header, sizeof(crr_header));
+   for (size_t i = 0; i < hashes.size(); i++)
+      memcpy(crr_data.data() + CRR_HASHES_OFFSET + i * CRO_HASH_SIZE, hashes[i].data(), CRO_HASH_SIZE);
+
+   if (!save_file(output_path, crr_data.data(), crr_data.size()))
+   {
+      printf("Failed to open file %s for writing! Exiting...\n", output_path);
+      return -1;
+   }
+
+   printf("Wrote %zu hashes (0x%zx bytes)\n", hashes.size(), crr_size);
+   return 0;
+}
@@ -0,0 +1,61 @@
+#include <cstring>
+
+#include "crotool.h"
+#include "cro_hash.h"
+
+// Files are hashed in parallel, one worker per file, so the regions
+// of each file are hashed serially
+int cmd_hash(int argc, char** argv)
+{
+   bool verify = false;
+   std::vector<const char*> paths;
+   for (int i = 0; i < argc; i++)
+   {
+      if (!strcmp(argv[i], "--verify"))
+         verify = true;
+      else
+         paths.push_back(argv[i]);
+   }
+   
+   if (paths.empty())
+   {
+      printf("Usage: crotool hash [--verify] <input.cro>...\n");
+      return -1;
+   }
+   
+   enum { HASH_OK, HASH_UPDATED, HASH_MISMATCH, HASH_FAILED };
+   std::vector<int> results(paths.size());
+   parallel_for(paths.size(), [&](size_t i)
+   {
+      Mapped_File cro_file;
+      uint8_t hash_table[CRO_HASH_REGIONS * CRO_HASH_SIZE];
+      if (!map_file(paths[i], cro_file))
+      {
+         results[i] = HASH_FAILED;
+         return;
+      }
+      
+      if (!cro_hash_regions(cro_file.data, cro_file.size, hash_table, false))
+         results[i] = HASH_FAILED;
+      else if (!memcmp(cro_file.data, hash_table, sizeof(hash_table)))
+         results[i] = HASH_OK;
+      else if (verify)
+         results[i] = HASH_MISMATCH;
+      else
+         results[i] = patch_file(paths[i], 0, hash_table, sizeof(hash_table)) ? HASH_UPDATED : HASH_FAILED;
+      
+      unmap_file(cro_file);
+   });
+   
+   int errors = 0;
+   for (size_t i = 0; i < paths.size(); i++)
+   {
+      static const char* result_names[] = {"ok", "updated", "MISMATCH", "FAILED"};
+      printf("%s: %s\n", paths[i], result_names[results[i]]);
+      if (results[i] >= HASH_MISMATCH)
+         errors++;
+   }
+   
+   printf("Hashed %zu CROs with %s, %d errors\n", paths.size(), sha256_backend(), errors);
+   return errors ? -1 : 0;
+}
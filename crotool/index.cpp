@@ -0,0 +1,244 @@
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <unordered_map>
+
+#include "crotool.h"
+#include "cro_index.h"
+
+typedef struct
+{
+   std::string name;
+   uint32_t seg_offset;
+} Index_Export;
+
+typedef struct
+{
+   uint32_t kind;
+   std::string module;
+   std::string name; // named imports only
+   uint32_t value;
+   uint32_t num_patches;
+} Index_Import;
+
+typedef struct
+{
+   std::string name;
+   std::vector<Index_Export> exports;
+   std::vector<Index_Import> imports;
+   std::vector<uint32_t> index_exports;
+   bool valid;
+} Index_Module;
+
+// Strings are stored once, "" first so offset 0 means no name
+typedef struct
+{
+   std::string data;
+   std::unordered_map<std::string, uint32_t> offsets;
+
+   uint32_t add(const std::string& str)
+   {
+      auto found = offsets.find(str);
+      if (found != offsets.end())
+         return found->second;
+
+      uint32_t offset = data.size();
+      data.append(str.c_str(), str.size() + 1);
+      offsets[str] = offset;
+      return offset;
+   }
+} Index_Strings;
+
+static void read_module(const CRO_Module& module, Index_Module& entry)
+{
+   const CRO_Header* cro_header = module_header(module);
+   entry.name = module.name;
+   for (uint32_t i = 0; i < cro_header->num_index_exports; i++)
+      entry.index_exports.push_back(((const CRO_Symbol*)(module.file.data + cro_header->offs_index_exports))[i].seg_offset);
+
+   for (uint32_t i = 0; i < cro_header->num_symbol_exports; i++)
+   {
+      const CRO_Symbol* symbol = (const CRO_Symbol*)(module.file.data + cro_header->offs_symbol_exports) + i;
+      Index_Export exp = {module_string(module, symbol->offs_name), symbol->seg_offset};
+      entry.exports.push_back(exp);
+   }
+
+   for (uint32_t i = 0; i < cro_header->num_symbol_imports; i++)
+   {
+      const CRO_Symbol* symbol = (const CRO_Symbol*)(module.file.data + cro_header->offs_symbol_imports) + i;
+      Index_Import imp = {INDEX_IMPORT_NAMED, "", module_string(module, symbol->offs_name), 0, module_chain_length(module, symbol->seg_offset)};
+      entry.imports.push_back(imp);
+   }
+
+   for (uint32_t m = 0; m < cro_header->num_import_module; m++)
+   {
+      const CRO_ModuleEntry* module_entry = (const CRO_ModuleEntry*)(module.file.data + cro_header->offs_import_module) + m;
+      std::string module_name = module_string(module, module_entry->offs_mod_name);
+      uint32_t tables[2] = {module_entry->import_indexed_symbol_table_offset, module_entry->import_anonymous_symbol_table_offset};
+      uint32_t counts[2] = {module_entry->import_indexed_symbol_num, module_entry->import_anonymous_symbol_num};
+      uint32_t kinds[2] = {INDEX_IMPORT_INDEX, INDEX_IMPORT_OFFSET};
+      for (int t = 0; t < 2; t++)
+      {
+         for (uint32_t i = 0; i < counts[t]; i++)
+         {
+            uint32_t offset = tables[t] + i * sizeof(CRO_Symbol);
+            if (offset > module.file.size - sizeof(CRO_Symbol)) break;
+
+            const CRO_Symbol* symbol = (const CRO_Symbol*)(module.file.data + offset);
+            Index_Import imp = {kinds[t], module_name, "", symbol->offs_name, module_chain_length(module, symbol->seg_offset)};
+            entry.imports.push_back(imp);
+         }
+      }
+   }
+
+   std::sort(entry.exports.begin(), entry.exports.end(), [](const Index_Export& a, const Index_Export& b)
+   {
+      return a.name < b.name;
+   });
+   std::sort(entry.imports.begin(), entry.imports.end(), [](const Index_Import& a, const Index_Import& b)
+   {
+      if (a.kind != b.kind)
+         return a.kind < b.kind;
+      if (a.module != b.module)
+         return a.module < b.module;
+      if (a.kind == INDEX_IMPORT_NAMED)
+         return a.name < b.name;
+      return a.value < b.value;
+   });
+}
+
+// CROs are read in parallel, then the tables are laid out one after the other
+int cmd_index(int argc, char** argv)
+{
+   std::vector<std::string> paths;
+   bool bad_args = false;
+   for (int i = 0; i < argc; i++)
+   {
+      if (!strcmp(argv[i], "--list") && i + 1 < argc)
+      {
+         std::ifstream list(argv[++i]);
+         std::string line;
+         bad_args |= !list.is_open();
+         while (std::getline(list, line))
+         {
+            if (!line.empty())
+               paths.push_back(line);
+         }
+      }
+      else
+         paths.push_back(argv[i]);
+   }
+
+   if (bad_args || paths.size() < 2)
+   {
+      printf("Usage: crotool index <output.crx> [--list <cro_list.txt>] <input.cro>...\n");
+      printf("  --list <cro_list.txt>  Also index the CROs listed one per line\n");
+      printf("  The index can be given to cro2elf instead of cro_list.txt and to elf2cro --modules\n");
+      return -1;
+   }
+
+   std::string output_path = paths[0];
+   paths.erase(paths.begin());
+
+   std::vector<Index_Module> modules(paths.size());
+   parallel_for(paths.size(), [&](size_t i)
+   {
+      CRO_Module module = {};
+      module.placement.path = paths[i].c_str();
+      module.placement.has_base = true;
+      modules[i].valid = map_file(module.placement.path, module.file) && cro_is_valid(module.file.data, module.file.size);
+      if (modules[i].valid)
+      {
+         module.name = module_string(module, module_header(module)->offs_mod_name);
+         read_module(module, modules[i]);
+      }
+      if (module.file.data)
+         unmap_file(module.file);
+   });
+
+   for (size_t i = 0; i < modules.size(); i++)
+   {
+      if (!modules[i].valid)
+      {
+         printf("%s: not a valid CRO\n", paths[i].c_str());
+         return -1;
+      }
+   }
+
+   std::sort(modules.begin(), modules.end(), [](const Index_Module& a, const Index_Module& b)
+   {
+      return a.name < b.name;
+   });
+   for (size_t i = 1; i < modules.size(); i++)
+   {
+      if (modules[i].name == modules[i - 1].name)
+      {
+         printf("Module %s is given twice! Exiting...\n", modules[i].name.c_str());
+         return -1;
+      }
+   }
+
+   Index_Strings strings;
+   strings.add("");
+   std::vector<CRO_Index_Module> module_table;
+   std::vector<CRO_Index_Export> export_table;
+   std::vector<uint32_t> index_export_table;
+   std::vector<CRO_Index_Import> import_table;
+   for (const auto& module : modules)
+   {
+      CRO_Index_Module entry = {strings.add(module.name), (uint32_t)export_table.size(), (uint32_t)module.exports.size(),
+                                (uint32_t)import_table.size(), (uint32_t)module.imports.size(),
+                                (uint32_t)index_export_table.size(), (uint32_t)module.index_exports.size()};
+      module_table.push_back(entry);
+      index_export_table.insert(index_export_table.end(), module.index_exports.begin(), module.index_exports.end());
+
+      for (const auto& exp : module.exports)
+      {
+         CRO_Index_Export export_entry = {strings.add(exp.name), exp.seg_offset};
+         export_table.push_back(export_entry);
+      }
+      for (const auto& imp : module.imports)
+      {
+         uint32_t value = imp.kind == INDEX_IMPORT_NAMED ? strings.add(imp.name) : imp.value;
+         CRO_Index_Import import_entry = {imp.kind, strings.add(imp.module), value, imp.num_patches};
+         import_table.push_back(import_entry);
+      }
+   }
+
+   CRO_Index_Header header = {};
+   header.magic = MAGIC_CRX0;
+   header.version = CRO_INDEX_VERSION;
+   header.offs_modules = sizeof(CRO_Index_Header);
+   header.num_modules = module_table.size();
+   header.offs_exports = header.offs_modules + module_table.size() * sizeof(CRO_Index_Module);
+   header.num_exports = export_table.size();
+   header.offs_index_exports = header.offs_exports + export_table.size() * sizeof(CRO_Index_Export);
+   header.num_index_exports = index_export_table.size();
+   header.offs_imports = header.offs_index_exports + index_export_table.size() * sizeof(uint32_t);
+   header.num_imports = import_table.size();
+   header.offs_strings = header.offs_imports + import_table.size() * sizeof(CRO_Index_Import);
+   header.size_strings = strings.data.size();
+   header.size_file = header.offs_strings + header.size_strings;
+
+   std::vector<char> index_data(header.size_file);
+   memcpy(index_data.data(), &header, sizeof(header));
+   if (!module_table.empty())
+      memcpy(index_data.data() + header.offs_modules, module_table.data(), module_table.size() * sizeof(CRO_Index_Module));
+   if (!export_table.empty())
+      memcpy(index_data.data() + header.offs_exports, export_table.data(), export_table.size() * sizeof(CRO_Index_Export));
+   if (!index_export_table.empty())
+      memcpy(index_data.data() + header.offs_index_exports, index_export_table.data(), index_export_table.size() * sizeof(uint32_t));
+   if (!import_table.empty())
+      memcpy(index_data.data() + header.offs_imports, import_table.data(), import_table.size() * sizeof(CRO_Index_Import));
+   memcpy(index_data.data() + header.offs_strings, strings.data.data(), strings.data.size());
+
+   if (!save_file(output_path.c_str(), index_data.data(), index_data.size()))
+   {
+      printf("Failed to open file %s for writing! Exiting...\n", output_path.c_str());
+      return -1;
+   }
+
+   printf("Indexed %zu modules, %zu exports, %zu imports, 0x%x bytes of strings\n",
+          module_table.size(), export_table.size(), import_table.size(), header.size_strings);
+   return 0;
+}
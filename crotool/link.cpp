@@ -0,0 +1,429 @@
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <unordered_map>
+
+#include "crotool.h"
+
+// Relocation types the RO loader applies, anything else is counted and skipped
+enum Link_Reloc_Type
+{
+   LINK_NONE = 0,
+   LINK_ABS32 = 2,
+   LINK_REL32 = 3,
+   LINK_THUMB_BRANCH = 10,
+   LINK_ARM_CALL = 28,
+   LINK_ARM_JUMP = 29,
+   LINK_ABS32_2 = 38,
+   LINK_PREL31 = 42,
+};
+
+enum Link_Kind
+{
+   LINK_NAMED = 0,
+   LINK_INDEX,
+   LINK_OFFSET,
+   LINK_STATIC,
+   LINK_STUB,
+   LINK_NUM_KINDS,
+};
+
+typedef struct
+{
+   uint8_t* target;
+   uint32_t addr;  // P
+   uint32_t value; // S + A
+   uint8_t type;
+} Link_Patch;
+
+// A module's memory as loaded: the CRO (or code.bin) at image_base and,
+// when it was loaded apart, the data and bss buffer at data_base
+typedef struct
+{
+   std::vector<uint8_t> image;
+   uint32_t image_base;
+   std::vector<uint8_t> data;
+   uint32_t data_base;
+   std::vector<Link_Patch> patches;
+   size_t applied[LINK_NUM_KINDS];
+   size_t unresolved;
+   size_t out_of_range;
+   size_t unsupported;
+} Link_Image;
+
+typedef struct
+{
+   std::unordered_map<std::string, uint32_t> named_exports;
+   std::unordered_map<std::string, int> module_index;
+} Link_Exports;
+
+static uint32_t read32(const uint8_t* ptr)
+{
+   uint32_t value;
+   memcpy(&value, ptr, sizeof(value));
+   return value;
+}
+
+static void write32(uint8_t* ptr, uint32_t value)
+{
+   memcpy(ptr, &value, sizeof(value));
+}
+
+// Each kernel runs over one type's patches, so the loop body has no type switch
+static void apply_abs32(const Link_Patch* patches, size_t count)
+{
+   for (size_t i = 0; i < count; i++)
+      write32(patches[i].target, patches[i].value);
+}
+
+static void apply_rel32(const Link_Patch* patches, size_t count)
+{
+   for (size_t i = 0; i < count; i++)
+      write32(patches[i].target, patches[i].value - patches[i].addr);
+}
+
+static void apply_prel31(const Link_Patch* patches, size_t count)
+{
+   for (size_t i = 0; i < count; i++)
+   {
+      uint32_t old = read32(patches[i].target);
+      write32(patches[i].target, (old & 0x80000000) | ((patches[i].value - patches[i].addr) & 0x7FFFFFFF));
+   }
+}
+
+// BL, and BLX when a call lands on ARM code
+static void apply_arm_branch(const Link_Patch* patches, size_t count)
+{
+   for (size_t i = 0; i < count; i++)
+   {
+      const Link_Patch& patch = patches[i];
+      uint32_t offset = patch.value - patch.addr;
+      uint32_t instr = read32(patch.target);
+      if (patch.type == LINK_ARM_CALL && (patch.value & 1))
+         instr = 0xFA000000 | (((offset >> 1) & 1) << 24);
+      else if (patch.type == LINK_ARM_CALL && (instr >> 28) == 0xF)
+         instr = 0xEB000000; // a BLX site calling ARM code goes back to BL
+      else
+         instr &= 0xFF000000;
+      write32(patch.target, instr | ((offset >> 2) & 0xFFFFFF));
+   }
+}
+
+// ARMv6 Thumb BL pair, 22 bit offset, BLX when the target is ARM code
+static void apply_thumb_branch(const Link_Patch* patches, size_t count)
+{
+   for (size_t i = 0; i < count; i++)
+   {
+      const Link_Patch& patch = patches[i];
+      bool to_arm = !(patch.value & 1);
+      uint32_t offset = patch.value - (to_arm ? patch.addr & ~3 : patch.addr);
+      uint16_t hi = 0xF000 | ((offset >> 12) & 0x7FF);
+      uint16_t lo = (to_arm ? 0xE800 : 0xF800) | ((offset >> 1) & (to_arm ? 0x7FE : 0x7FF));
+      memcpy(patch.target, &hi, sizeof(hi));
+      memcpy(patch.target + 2, &lo, sizeof(lo));
+   }
+}
+
+static const struct
+{
+   uint8_t type;
+   const char* name;
+   void (*apply)(const Link_Patch* patches, size_t count);
+} link_kernels[] =
+{
+   {LINK_ABS32, "abs32", apply_abs32},
+   {LINK_REL32, "rel32", apply_rel32},
+   {LINK_THUMB_BRANCH, "thumb_branch", apply_thumb_branch},
+   {LINK_ARM_CALL, "arm_call", apply_arm_branch},
+   {LINK_ARM_JUMP, "arm_jump", apply_arm_branch},
+   {LINK_ABS32_2, "abs32_2", apply_abs32},
+   {LINK_PREL31, "prel31", apply_prel31},
+};
+
+#define LINK_NUM_KERNELS (sizeof(link_kernels) / sizeof(link_kernels[0]))
+
+static int kernel_index(uint8_t type)
+{
+   for (size_t i = 0; i < LINK_NUM_KERNELS; i++)
+   {
+      if (link_kernels[i].type == type)
+         return i;
+   }
+   return -1;
+}
+
+static const char* kind_names[LINK_NUM_KINDS] = {"named", "index", "offset", "static", "stub"};
+
+// Address of a packed (offset << 4 | segment) location in a module
+static bool seg_offset_address(const CRO_Module& module, uint32_t seg_offset, uint32_t& addr)
+{
+   uint32_t seg_idx = seg_offset & 0xf;
+   if (seg_idx >= module_header(module)->num_segments)
+      return false;
+   addr = module_segment_address(module, seg_idx) + (seg_offset >> 4);
+   return true;
+}
+
+// Where a word at addr lives in the image, NULL when it's outside of it
+static uint8_t* image_at(Link_Image& image, uint32_t addr)
+{
+   if ((uint64_t)(addr - image.data_base) + 4 <= image.data.size())
+      return &image.data[addr - image.data_base];
+   if ((uint64_t)(addr - image.image_base) + 4 <= image.image.size())
+      return &image.image[addr - image.image_base];
+   return NULL;
+}
+
+static bool add_patch(const CRO_Module& module, Link_Image& image, const CRO_Relocation& reloc, uint32_t value, Link_Kind kind)
+{
+   uint32_t addr;
+   uint8_t* target = seg_offset_address(module, reloc.seg_offset, addr) ? image_at(image, addr) : NULL;
+   if (!target)
+   {
+      image.out_of_range++;
+      return false;
+   }
+
+   Link_Patch patch = {target, addr, value, reloc.type};
+   image.patches.push_back(patch);
+   image.applied[kind]++;
+   return true;
+}
+
+// Import patches run from chain_offset until the entry marked last. Like the
+// loader, every site is first pointed at the unresolved stub when the module
+// has one, so sites left unresolved match a RAM dump too.
+static void add_chain(const CRO_Module& module, Link_Image& image, uint32_t chain_offset, bool resolved, uint32_t value, Link_Kind kind)
+{
+   if (!chain_offset) return;
+
+   uint32_t stub = 0;
+   uint32_t stub_seg_offset = module_header(module)->offs_unresolved;
+   bool has_stub = stub_seg_offset != 0xFFFFFFFF && seg_offset_address(module, stub_seg_offset, stub);
+   for (uint32_t offset = chain_offset; offset <= module.file.size - sizeof(CRO_Relocation); offset += sizeof(CRO_Relocation))
+   {
+      const CRO_Relocation* reloc = (const CRO_Relocation*)(module.file.data + offset);
+      bool in_range = !has_stub || add_patch(module, image, *reloc, stub + reloc->addend, LINK_STUB);
+      if (!resolved)
+         image.unresolved++;
+      else if (in_range)
+         add_patch(module, image, *reloc, value + reloc->addend, kind);
+      if (reloc->last_entry) break;
+   }
+}
+
+static void load_image(const CRO_Module& module, const std::vector<char>& code, Link_Image& image)
+{
+   const CRO_Header* cro_header = module_header(module);
+   memset(image.applied, 0, sizeof(image.applied));
+   image.unresolved = image.out_of_range = image.unsupported = 0;
+   image.data_base = 0;
+   if (module.is_static)
+   {
+      image.image.assign(code.begin(), code.end());
+      image.image_base = STATIC_BASE;
+      return;
+   }
+
+   image.image.assign(module.file.data, module.file.data + module.file.size);
+   image.image_base = module.placement.base;
+   if (module.placement.has_data_base)
+   {
+      image.data.assign(cro_header->size_data + cro_header->size_bss, 0);
+      if (cro_header->offs_data <= module.file.size && cro_header->size_data <= module.file.size - cro_header->offs_data)
+         memcpy(image.data.data(), module.file.data + cro_header->offs_data, cro_header->size_data);
+      image.data_base = module.placement.data_base;
+   }
+}
+
+// Walks every import and static relocation of the module into patches
+static void gather_patches(const std::vector<CRO_Module>& modules, const Link_Exports& exports, size_t module_index, Link_Image& image)
+{
+   const CRO_Module& module = modules[module_index];
+   const CRO_Header* cro_header = module_header(module);
+
+   for (uint32_t i = 0; i < cro_header->num_symbol_imports; i++)
+   {
+      const CRO_Symbol* symbol = (const CRO_Symbol*)(module.file.data + cro_header->offs_symbol_imports) + i;
+      auto found = exports.named_exports.find(module_string(module, symbol->offs_name));
+      bool resolved = found != exports.named_exports.end();
+      add_chain(module, image, symbol->seg_offset, resolved, resolved ? found->second : 0, LINK_NAMED);
+   }
+
+   for (uint32_t m = 0; m < cro_header->num_import_module; m++)
+   {
+      const CRO_ModuleEntry* entry = (const CRO_ModuleEntry*)(module.file.data + cro_header->offs_import_module) + m;
+      auto found = exports.module_index.find(module_string(module, entry->offs_mod_name));
+      const CRO_Module* exporter = found != exports.module_index.end() ? &modules[found->second] : NULL;
+
+      for (uint32_t i = 0; i < entry->import_indexed_symbol_num; i++)
+      {
+         uint32_t offset = entry->import_indexed_symbol_table_offset + i * sizeof(CRO_Symbol);
+         if (offset > module.file.size - sizeof(CRO_Symbol)) break;
+
+         const CRO_Symbol* symbol = (const CRO_Symbol*)(module.file.data + offset);
+         uint32_t value = 0;
+         bool resolved = exporter && symbol->offs_name < module_header(*exporter)->num_index_exports
+            && seg_offset_address(*exporter, ((const CRO_Symbol*)(exporter->file.data + module_header(*exporter)->offs_index_exports))[symbol->offs_name].seg_offset, value);
+         add_chain(module, image, symbol->seg_offset, resolved, value, LINK_INDEX);
+      }
+
+      for (uint32_t i = 0; i < entry->import_anonymous_symbol_num; i++)
+      {
+         uint32_t offset = entry->import_anonymous_symbol_table_offset + i * sizeof(CRO_Symbol);
+         if (offset > module.file.size - sizeof(CRO_Symbol)) break;
+
+         const CRO_Symbol* symbol = (const CRO_Symbol*)(module.file.data + offset);
+         uint32_t value = 0;
+         bool resolved = exporter && seg_offset_address(*exporter, symbol->offs_name, value);
+         add_chain(module, image, symbol->seg_offset, resolved, value, LINK_OFFSET);
+      }
+   }
+
+   // Static relocations name the referenced segment of the module itself
+   for (uint32_t i = 0; i < cro_header->num_static_relocations; i++)
+   {
+      const CRO_Relocation* reloc = (const CRO_Relocation*)(module.file.data + cro_header->offs_static_relocations) + i;
+      if (reloc->last_entry >= cro_header->num_segments)
+      {
+         image.out_of_range++;
+         continue;
+      }
+      add_patch(module, image, *reloc, module_segment_address(module, reloc->last_entry) + reloc->addend, LINK_STATIC);
+   }
+}
+
+// Patches are grouped by type and each group goes through its kernel in one
+// call. A stable sort keeps chain order for patches of the same type, and a
+// resolved patch after the stub patch for its site.
+static void apply_patches(Link_Image& image, std::vector<size_t>& type_counts)
+{
+   std::stable_sort(image.patches.begin(), image.patches.end(), [](const Link_Patch& a, const Link_Patch& b)
+   {
+      return a.type < b.type;
+   });
+
+   type_counts.assign(LINK_NUM_KERNELS, 0);
+   for (size_t start = 0, end; start < image.patches.size(); start = end)
+   {
+      uint8_t type = image.patches[start].type;
+      for (end = start; end < image.patches.size() && image.patches[end].type == type; end++);
+
+      int kernel = kernel_index(type);
+      if (kernel >= 0)
+      {
+         link_kernels[kernel].apply(&image.patches[start], end - start);
+         type_counts[kernel] += end - start;
+      }
+      else if (type != LINK_NONE)
+         image.unsupported += end - start;
+   }
+}
+
+int cmd_link(int argc, char** argv)
+{
+   CRO_Module_Args args;
+   const char* out_dir = NULL;
+   bool args_ok = parse_module_args(argc, argv, true, args, [&](int i)
+   {
+      if (!strcmp(argv[i], "--out") && i + 1 < argc)
+      {
+         out_dir = argv[i + 1];
+         return 2;
+      }
+      return 0;
+   });
+
+   if (!args_ok)
+   {
+      printf("Usage: crotool link [--static <static.crs> <code.bin>] [--out <dir>] <input.cro>[@<base>[,<data>]]...\n");
+      printf("  --static <crs> <bin>  The static module, its relocations are applied to code.bin\n");
+      printf("  --out <dir>           Write <module>.bin, <module>.data.bin and code.bin images there,\n");
+      printf("                        without it only the relocation counts are printed\n");
+      printf("  @<base>[,<data>]      Load addresses, CROs without one follow code.bin or the previous\n");
+      printf("                        CRO page aligned and keep their data in place\n");
+      return -1;
+   }
+
+   std::vector<char> code;
+   if (args.code_path && !load_file(args.code_path, code))
+   {
+      printf("Failed to open file %s! Exiting...\n", args.code_path);
+      return -1;
+   }
+
+   std::vector<CRO_Module> modules;
+   if (!load_modules(args.placements, args.static_path, code.size(), modules))
+   {
+      unload_modules(modules);
+      return -1;
+   }
+
+   // Named exports resolve across the whole set, the first module to export
+   // a name wins like it would in the loader's load order
+   Link_Exports exports;
+   for (size_t m = 0; m < modules.size(); m++)
+   {
+      const CRO_Module& module = modules[m];
+      const CRO_Header* cro_header = module_header(module);
+      if (!exports.module_index.insert(std::make_pair(module.name, (int)m)).second)
+         printf("Warning: module %s is loaded twice, imports use the first\n", module.name.c_str());
+
+      for (uint32_t i = 0; i < cro_header->num_symbol_exports; i++)
+      {
+         const CRO_Symbol* symbol = (const CRO_Symbol*)(module.file.data + cro_header->offs_symbol_exports) + i;
+         uint32_t addr;
+         if (seg_offset_address(module, symbol->seg_offset, addr))
+            exports.named_exports.insert(std::make_pair(module_string(module, symbol->offs_name), addr));
+      }
+   }
+
+   std::vector<Link_Image> images(modules.size());
+   std::vector<std::vector<size_t>> type_counts(modules.size());
+   parallel_for(modules.size(), [&](size_t m)
+   {
+      load_image(modules[m], code, images[m]);
+      gather_patches(modules, exports, m, images[m]);
+      apply_patches(images[m], type_counts[m]);
+   });
+
+   int errors = 0;
+   std::vector<size_t> type_totals(LINK_NUM_KERNELS, 0);
+   printf("%-24s %10s %10s %10s %10s %10s %10s %10s\n", "module", kind_names[0], kind_names[1], kind_names[2], kind_names[3], kind_names[4],
+          "unresolved", "skipped");
+   for (size_t m = 0; m < modules.size(); m++)
+   {
+      const Link_Image& image = images[m];
+      printf("%-24s %10zu %10zu %10zu %10zu %10zu %10zu %10zu\n", modules[m].name.c_str(), image.applied[LINK_NAMED], image.applied[LINK_INDEX],
+             image.applied[LINK_OFFSET], image.applied[LINK_STATIC], image.applied[LINK_STUB], image.unresolved,
+             image.out_of_range + image.unsupported);
+      for (size_t k = 0; k < LINK_NUM_KERNELS; k++)
+         type_totals[k] += type_counts[m][k];
+      if (image.unresolved || image.out_of_range || image.unsupported)
+         errors++;
+
+      if (!out_dir) continue;
+
+      // Module names can carry the path they were built from
+      const std::string& name = modules[m].name;
+      std::string base = std::string(out_dir) + "/" + (modules[m].is_static ? std::string("code") : name.substr(name.find_last_of('/') + 1));
+      if (!save_file((base + ".bin").c_str(), image.image.data(), image.image.size())
+          || (!image.data.empty() && !save_file((base + ".data.bin").c_str(), image.data.data(), image.data.size())))
+      {
+         printf("Failed to open file %s.bin for writing! Exiting...\n", base.c_str());
+         unload_modules(modules);
+         return -1;
+      }
+   }
+
+   printf("By type:");
+   for (size_t k = 0; k < LINK_NUM_KERNELS; k++)
+   {
+      if (type_totals[k])
+         printf(" %s %zu", link_kernels[k].name, type_totals[k]);
+   }
+   printf("\nLinked %zu modules, %d with unresolved or skipped relocations\n", modules.size(), errors);
+
+   unload_modules(modules);
+   return errors ? -1 : 0;
+}
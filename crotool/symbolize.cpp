@@ -0,0 +1,224 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+
+#include "crotool.h"
+
+typedef struct
+{
+   uint32_t addr;
+   std::string name;
+} Symbolize_Export;
+
+// One loaded segment, with its exports sorted by address
+typedef struct
+{
+   uint32_t start;
+   uint32_t end;
+   int module;
+   int segment;
+   std::vector<Symbolize_Export> exports;
+} Symbolize_Segment;
+
+static const char* segment_name(const CRO_Module& module, int segment)
+{
+   static const char* names[] = {".text", ".rodata", ".data", ".bss"};
+   const CRO_Segment& seg = module_segments(module)[segment];
+   if (seg.type == SEG_TEXT && seg.offset == 0)
+      return ".cro_info";
+   return seg.type <= SEG_BSS ? names[seg.type] : ".unk";
+}
+
+// Adds the module's segments and sorts each one's exports. Index exports
+// only get a name where no named export sits at the same address.
+static void add_module_segments(const CRO_Module& module, int module_index, std::vector<Symbolize_Segment>& index)
+{
+   const char* cro_data = module.file.data;
+   const CRO_Header* cro_header = module_header(module);
+   const CRO_Segment* segments = module_segments(module);
+
+   size_t first = index.size();
+   std::vector<int> segment_slots(cro_header->num_segments, -1);
+   for (uint32_t i = 0; i < cro_header->num_segments; i++)
+   {
+      if (!segments[i].size) continue;
+
+      Symbolize_Segment seg;
+      seg.start = module_segment_address(module, i);
+      seg.end = seg.start + segments[i].size;
+      seg.module = module_index;
+      seg.segment = i;
+      segment_slots[i] = index.size();
+      index.push_back(seg);
+   }
+
+   auto add_export = [&](uint32_t seg_offset, const std::string& name)
+   {
+      uint32_t seg_idx = seg_offset & 0xf;
+      if (seg_idx >= cro_header->num_segments || segment_slots[seg_idx] < 0) return;
+
+      Symbolize_Segment& seg = index[segment_slots[seg_idx]];
+      Symbolize_Export entry = {seg.start + (seg_offset >> 4), name};
+      seg.exports.push_back(entry);
+   };
+
+   for (uint32_t i = 0; i < cro_header->num_symbol_exports; i++)
+   {
+      const CRO_Symbol* symbol = (const CRO_Symbol*)(cro_data + cro_header->offs_symbol_exports) + i;
+      add_export(symbol->seg_offset, module_string(module, symbol->offs_name));
+   }
+
+   for (uint32_t i = 0; i < cro_header->num_index_exports; i++)
+   {
+      const CRO_Symbol* symbol = (const CRO_Symbol*)(cro_data + cro_header->offs_index_exports) + i;
+      add_export(symbol->seg_offset, "export_index_" + std::to_string(symbol->offs_name));
+   }
+
+   for (size_t i = first; i < index.size(); i++)
+   {
+      std::vector<Symbolize_Export>& exports = index[i].exports;
+      std::stable_sort(exports.begin(), exports.end(), [](const Symbolize_Export& a, const Symbolize_Export& b)
+      {
+         return a.addr < b.addr;
+      });
+      exports.erase(std::unique(exports.begin(), exports.end(), [](const Symbolize_Export& a, const Symbolize_Export& b)
+      {
+         return a.addr == b.addr;
+      }), exports.end());
+   }
+}
+
+static bool read_addresses(FILE* file, std::vector<uint32_t>& addrs)
+{
+   char line[256];
+   while (fgets(line, sizeof(line), file))
+   {
+      char* end;
+      uint32_t addr = strtoul(line, &end, 16);
+      if (end != line)
+         addrs.push_back(addr);
+   }
+   return !ferror(file);
+}
+
+// Segments are sorted by start and may not overlap, so each address is an
+// upper_bound over the segments and then over that segment's exports
+int cmd_symbolize(int argc, char** argv)
+{
+   CRO_Module_Args args;
+   const char* addrs_path = NULL;
+   bool args_ok = parse_module_args(argc, argv, true, args, [&](int i)
+   {
+      if (!strcmp(argv[i], "--addrs") && i + 1 < argc)
+      {
+         addrs_path = argv[i + 1];
+         return 2;
+      }
+      return 0;
+   });
+
+   if (!args_ok)
+   {
+      printf("Usage: crotool symbolize [--static <static.crs> <code.bin>] [--addrs <file>] <input.cro>[@<base>[,<data>]]...\n");
+      printf("  --static <crs> <bin>  The static module, its segments are absolute addresses in code.bin\n");
+      printf("  --addrs <file>        Hex addresses, one per line, instead of stdin\n");
+      printf("  @<base>[,<data>]      Where the module and its data buffer were loaded, CROs without\n");
+      printf("                        one follow code.bin or the previous CRO page aligned\n");
+      return -1;
+   }
+
+   auto start = std::chrono::steady_clock::now();
+
+   // code.bin only backs the static module's segments, the rest of it is
+   // reported as an offset into the file
+   uint32_t code_size = 0;
+   if (args.code_path)
+   {
+      Mapped_File code_file;
+      if (!map_file(args.code_path, code_file))
+      {
+         printf("Failed to open file %s! Exiting...\n", args.code_path);
+         return -1;
+      }
+      code_size = code_file.size;
+      unmap_file(code_file);
+   }
+
+   std::vector<CRO_Module> modules;
+   if (!load_modules(args.placements, args.static_path, code_size, modules))
+   {
+      unload_modules(modules);
+      return -1;
+   }
+
+   std::vector<Symbolize_Segment> index;
+   for (size_t i = 0; i < modules.size(); i++)
+      add_module_segments(modules[i], i, index);
+
+   std::sort(index.begin(), index.end(), [](const Symbolize_Segment& a, const Symbolize_Segment& b)
+   {
+      return a.start < b.start;
+   });
+
+   for (size_t i = 1; i < index.size(); i++)
+   {
+      if (index[i].start < index[i - 1].end)
+      {
+         const CRO_Module& module = modules[index[i].module];
+         const CRO_Module& prev_module = modules[index[i - 1].module];
+         printf("%s %s at %08x overlaps %s %s at %08x\n",
+                module.name.c_str(), segment_name(module, index[i].segment), index[i].start,
+                prev_module.name.c_str(), segment_name(prev_module, index[i - 1].segment), index[i - 1].start);
+         unload_modules(modules);
+         return -1;
+      }
+   }
+
+   std::vector<uint32_t> addrs;
+   FILE* addrs_file = addrs_path ? fopen(addrs_path, "r") : stdin;
+   bool read_ok = addrs_file && read_addresses(addrs_file, addrs);
+   if (addrs_file && addrs_path)
+      fclose(addrs_file);
+   if (!read_ok)
+   {
+      printf("Failed to read addresses from %s! Exiting...\n", addrs_path ? addrs_path : "stdin");
+      unload_modules(modules);
+      return -1;
+   }
+
+   auto segment_less = [](uint32_t addr, const Symbolize_Segment& seg) { return addr < seg.start; };
+   auto export_less = [](uint32_t addr, const Symbolize_Export& entry) { return addr < entry.addr; };
+
+   size_t resolved = 0;
+   for (uint32_t addr : addrs)
+   {
+      auto seg = std::upper_bound(index.begin(), index.end(), addr, segment_less);
+      if (seg == index.begin() || addr >= (--seg)->end)
+      {
+         if (addr >= STATIC_BASE && addr - STATIC_BASE < code_size)
+            printf("%08x code.bin+0x%x\n", addr, addr - STATIC_BASE);
+         else
+            printf("%08x ?\n", addr);
+         continue;
+      }
+
+      resolved++;
+      const CRO_Module& module = modules[seg->module];
+      auto entry = std::upper_bound(seg->exports.begin(), seg->exports.end(), addr, export_less);
+      if (entry == seg->exports.begin())
+         printf("%08x %s %s+0x%x\n", addr, module.name.c_str(), segment_name(module, seg->segment), addr - seg->start);
+      else
+      {
+         --entry;
+         printf("%08x %s %s+0x%x %s+0x%x\n", addr, module.name.c_str(), segment_name(module, seg->segment), addr - seg->start,
+                entry->name.c_str(), addr - entry->addr);
+      }
+   }
+
+   unload_modules(modules);
+
+   double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+   fprintf(stderr, "Resolved %zu of %zu addresses over %zu segments in %.3f ms\n", resolved, addrs.size(), index.size(), ms);
+   return 0;
+}
@@ -5,22 +5,43 @@
 
 #include <algorithm>
 #include <climits>
+#include <cstdint>
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <stdexcept>
 #include <string>
 #include <vector>
 
+/*
+string_ref
+  Non-owning view of a key's bytes, usually pointing straight into an
+  existing string table so no per-key copies are made. The tools are
+  built as C++11, so this stands in for std::string_view.
+*/
+struct string_ref {
+    const char* data;
+    std::size_t size;
+
+    string_ref() : data(nullptr), size(0) {}
+    string_ref(const char* data_, std::size_t size_) : data(data_), size(size_) {}
+    string_ref(const char* str) : data(str), size(std::strlen(str)) {}
+    string_ref(const std::string& str) : data(str.data()), size(str.size()) {}
+
+    bool operator==(const string_ref& other) const {
+        return size == other.size && std::memcmp(data, other.data, size) == 0;
+    }
+};
+
 /*
 bit_trie
-  bit_tries are associative containers that store elements formed
-  by the combination of a key value and a mapped value, and which
-  allows for fast retrieval of individual elements based on their keys.
+  bit_tries are associative containers that map a set of keys to their
+  position in the input range, and which allows for fast retrieval of
+  individual elements based on their keys.
  Key
   Type of the key values. Each element in an bit_tire is uniquely
-  identified by its key value.
- Value
-  Type of the mapped values.
+  identified by its key value. Keys are stored by value, so a cheap
+  view type such as string_ref is preferred over owning strings.
  BitTester
   A binary function object type that takes an object of type Key
   and a size_t integer (bit address) as arguments and returns a bool.
@@ -28,53 +49,73 @@ bit_trie
   should return a consistent result for the same key and the same
   bit address. The results for two differents key should be different
   for at least one bit address.
+
+ Nodes are packed into the same 8-byte layout as a CRO export tree entry
+ (bit address, two 15-bit child indexes with end flags, key index), so a
+ trie holds at most 0x8000 keys of up to 0x1FFF bytes.
 */
 template <
     typename Key,
-    typename Value,
     typename BitTester
 >
 class bit_trie {
-    struct Branch{
-        int offset;
-        bool end;
+public:
+    struct Branch {
+        uint16_t next_index : 15;
+        uint16_t end : 1;
     };
     struct Node {
-        std::size_t bit_address;
+        uint16_t bit_address;
         Branch left;
         Branch right;
-        Key key; // this can be removed if use only at_no_verify to retrieve elements
-        Value value;
+        uint16_t value;
     };
+    static_assert(sizeof(Node) == 8, "bit_trie::Node must stay packed");
 
+    static constexpr std::size_t max_keys = 0x8000;
+    static constexpr uint16_t invalid_bit_address = 0xFFFF;
+
+private:
     BitTester tester;
-    Node& at_node(const Key& key) {
-        size_t cur_pos = 0;
+    std::vector<Key> keys;
+
+    static Branch make_branch(std::size_t index, bool end) {
+        Branch branch;
+        branch.next_index = static_cast<uint16_t>(index);
+        branch.end = end;
+        return branch;
+    }
+
+    const Node& at_node(const Key& key) const {
         Branch next = nodes[0].left;
         while (true) {
-            cur_pos += next.offset;
+            const Node& node = nodes[next.next_index];
             if (next.end)
-                return nodes[cur_pos];
-            if (tester(key, nodes[cur_pos].bit_address)) {
-                next = nodes[cur_pos].right;
+                return node;
+            if (tester(key, node.bit_address)) {
+                next = node.right;
             } else {
-                next = nodes[cur_pos].left;
+                next = node.left;
             }
         }
     }
-    void build(typename std::vector<Node>::iterator begin, typename std::vector<Node>::iterator end, std::size_t bit_length) {
+    void build(std::size_t begin, std::size_t end, std::size_t bit_length) {
+        // a single element is its own guiding node
+        if (end - begin == 1) {
+            nodes[begin].left = make_branch(begin, true);
+            return;
+        }
+
         // counting number of elements and numbers passing each bit test
         std::vector<std::size_t> pass_count(bit_length);
-        std::size_t count = 0;
-        std::for_each(begin, end, [&](const Node& node){
+        std::size_t count = end - begin;
+        for (std::size_t i = begin; i < end; ++i) {
+            const Key& key = keys[nodes[i].value];
             for (std::size_t bit = 0; bit < bit_length; ++bit) {
-                if (tester(node.key, bit))
+                if (tester(key, bit))
                     ++pass_count[bit];
             }
-            ++count;
-        });
-        if (count == 1)
-            return;
+        }
 
         // find the best address that partition the elements evenly
         long badness = LONG_MAX;
@@ -88,25 +129,23 @@ class bit_trie {
         }
 
         // partition
-        auto partition_pos = std::partition(begin, end, [&](const Node& node){
-            return !tester(node.key, best_address);
+        auto partition_pos = std::partition(nodes.begin() + begin, nodes.begin() + end, [&](const Node& node){
+            return !tester(keys[node.value], best_address);
         });
-        auto partition_distance = std::distance(begin, partition_pos);
-        if (partition_distance == count || partition_distance == 0)
+        std::size_t middle = std::distance(nodes.begin(), partition_pos);
+        if (middle == begin || middle == end)
             throw std::invalid_argument("Duplicated keys.");
 
         // build trie for each partition
-        build(begin, partition_pos, bit_length);
-        build(partition_pos, end, bit_length);
+        build(begin, middle, bit_length);
+        build(middle, end, bit_length);
 
         // let right guiding node be the first level node
-        partition_pos->right = partition_pos->left;
-        partition_pos->left = begin->left;
-        partition_pos->left.offset -= partition_distance;
-        partition_pos->bit_address = best_address;
+        nodes[middle].right = nodes[middle].left;
+        nodes[middle].left = nodes[begin].left;
+        nodes[middle].bit_address = static_cast<uint16_t>(best_address);
         // and left guiding node be the main guiding node
-        begin->left.offset = partition_distance;
-        begin->left.end = false;
+        nodes[begin].left = make_branch(middle, false);
     }
 public:
     std::vector<Node> nodes;
@@ -116,41 +155,41 @@ public:
         InputInterator end,
         std::size_t bit_length,
         const BitTester& tester_ = BitTester()
-    ) : nodes(std::distance(begin, end)), tester(tester_) {
-        constexpr std::size_t invalid_bit_address = static_cast<std::size_t>(-1);
-        std::transform(begin, end, nodes.begin(), [](std::pair<Key, Value> pair){
-            return Node {
-                invalid_bit_address,
-                {0, true},
-                {0, true},
-                pair.first,
-                pair.second
-            };
-        });
-        if (nodes.empty())
+    ) : tester(tester_), keys(begin, end) {
+        if (keys.empty())
             throw std::length_error("Empty range.");
+        if (keys.size() > max_keys || bit_length > invalid_bit_address)
+            throw std::length_error("Too many or too long keys.");
+
+        nodes.resize(keys.size());
+        for (std::size_t i = 0; i < nodes.size(); ++i) {
+            nodes[i].bit_address = invalid_bit_address;
+            nodes[i].left = make_branch(0, true);
+            nodes[i].right = make_branch(0, true);
+            nodes[i].value = static_cast<uint16_t>(i);
+        }
 
-        build(nodes.begin(), nodes.end(), bit_length);
+        build(0, nodes.size(), bit_length);
     }
 
-    Value& at(const Key& key) {
-        Node& node = at_node(key);
-        if (node.key == key)
+    std::size_t at(const Key& key) const {
+        const Node& node = at_node(key);
+        if (keys[node.value] == key)
             return node.value;
         throw std::out_of_range("Element not found.");
     }
 
-    Value& at_no_verify(const Key& key) {
+    std::size_t at_no_verify(const Key& key) const {
         return at_node(key).value;
     }
 
 };
 
-bool string_tester(const std::string& key, std::size_t position) {
+inline bool string_tester(const string_ref& key, std::size_t position) {
     std::size_t byte = position >> 3;
-    if (byte >= key.size())
+    if (byte >= key.size)
         return false;
-    return (key[byte] >> (position & 7)) & 1;
+    return (key.data[byte] >> (position & 7)) & 1;
 }
 
 #endif
@@ -1,15 +1,27 @@
 #include <cstdlib>
+#include <dirent.h>
+#include <fstream>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <sys/stat.h>
 
 #include "elfio/elfio.hpp"
 #include "elfio/elfio_dump.hpp"
 #include "cro.h"
+#include "cro_hash.h"
+#include "cro_index.h"
+#include "tool_stats.h"
+#include "alloc_trace.h"
 #include "bit_trie.h"
 
 #include <map>
 
 using namespace ELFIO;
 
+// Keyed by views into the export strtab, one node per export
+typedef bit_trie<string_ref, decltype(&string_tester)> export_trie;
+
 typedef struct
 {
    void* cro_data;
@@ -26,11 +38,45 @@ typedef struct
    Elf_Half section_index;
 } ELF_Symbol;
 
+enum CRO_Symbol_Kind
+{
+   SYM_SKIP = 0,
+   SYM_EXPORT,
+   SYM_IMPORT,
+   SYM_INDEX_IMPORT,
+   SYM_OFFSET_IMPORT,
+};
+
+typedef struct
+{
+   std::string name;
+   std::vector<std::pair<uint32_t, Elf_Word> > index_imports; // (export index, dynsym index)
+   std::vector<std::pair<uint32_t, Elf_Word> > offset_imports; // (segment offset, dynsym index)
+} CRO_ImportModule;
+
+typedef struct
+{
+   int module; // -1 when several modules export the name
+   uint8_t kind; // SYM_INDEX_IMPORT or SYM_OFFSET_IMPORT
+   uint32_t value; // export index or segment offset within the module
+} CRO_ModuleSymbol;
+
+typedef struct
+{
+   std::string self_name;
+   std::vector<CRO_ImportModule> modules;
+   std::unordered_map<std::string, CRO_ModuleSymbol> symbols;
+} CRO_ModuleMap;
+
 void push_data(CRO_Context& context, const void* data, size_t size)
 {
    context.cro_data = realloc(context.cro_data, context.cro_size + size);
+   tool_stats_count(STAT_ALLOCATIONS);
    if (data != NULL)
+   {
       memcpy((char*)context.cro_data + context.cro_size, data, size);
+      tool_stats_count(STAT_BYTES_COPIED, size);
+   }
    else
       memset((char*)context.cro_data + context.cro_size, 0, size);
    context.cro_size += size;
@@ -47,12 +93,150 @@ void cro_align_up(CRO_Context& context, size_t align, uint8_t fill = 0)
    size_t old_size = context.cro_size;
    context.cro_size = (context.cro_size + (align - context.cro_size % align) % align);
    context.cro_data = realloc(context.cro_data, context.cro_size);
+   tool_stats_count(STAT_ALLOCATIONS);
    context.cro_header = (CRO_Header*)context.cro_data;
    memset((char*)context.cro_data + old_size, fill, context.cro_size - old_size);
 }
 
+void cro_pad_to(CRO_Context& context, size_t offset, uint8_t fill = 0)
+{
+   size_t old_size = context.cro_size;
+   context.cro_size = offset;
+   context.cro_data = realloc(context.cro_data, context.cro_size);
+   tool_stats_count(STAT_ALLOCATIONS);
+   context.cro_header = (CRO_Header*)context.cro_data;
+   memset((char*)context.cro_data + old_size, fill, context.cro_size - old_size);
+}
+
+size_t align_up(size_t value, size_t align)
+{
+   return value + (align - value % align) % align;
+}
+
+typedef struct
+{
+   size_t text;
+   size_t rodata, rodata_align;
+   size_t export_tables; // module name through export strtab
+   size_t import_tables; // module table through static relocations
+   size_t data, data_align;
+} CRO_LayoutSizes;
+
+typedef struct
+{
+   size_t offs_text;
+   size_t offs_rodata;
+   size_t offs_export_tables;
+   size_t code_end;
+   size_t offs_import_tables;
+   size_t offs_data;
+   size_t size_file;
+} CRO_Layout;
+
+CRO_Layout cro_plan_layout(const CRO_LayoutSizes& sizes, bool compact)
+{
+   CRO_Layout layout;
+   layout.offs_text = align_up(sizeof(CRO_Header), 0x80);
+   
+   if (!compact)
+   {
+      layout.offs_rodata = align_up(layout.offs_text + sizes.text, 0x1000);
+      layout.code_end = align_up(layout.offs_rodata + sizes.rodata, 0x1000);
+      layout.offs_export_tables = layout.code_end;
+      layout.offs_import_tables = layout.offs_export_tables + sizes.export_tables;
+      layout.offs_data = layout.offs_import_tables + sizes.import_tables;
+      layout.size_file = align_up(layout.offs_data + sizes.data, 0x1000);
+      return layout;
+   }
+   
+   // The loader only remaps the code region, so its end is the one page
+   // boundary that matters. .rodata shares pages with .text, the export
+   // tables are only ever read and can sit in the slack before the boundary.
+   // Import tables get patched while linking and have to stay writable. .data
+   // is copied out to its own buffer, so nothing after it needs padding.
+   layout.offs_rodata = align_up(layout.offs_text + sizes.text, sizes.rodata_align);
+   size_t rodata_end = align_up(layout.offs_rodata + sizes.rodata, 4);
+   layout.code_end = align_up(rodata_end, 0x1000);
+   if (rodata_end + sizes.export_tables <= layout.code_end)
+      layout.offs_export_tables = rodata_end;
+   else
+      layout.offs_export_tables = layout.code_end;
+   layout.offs_import_tables = std::max(layout.code_end, layout.offs_export_tables + sizes.export_tables);
+   layout.offs_data = align_up(layout.offs_import_tables + sizes.import_tables, sizes.data_align);
+   layout.size_file = align_up(layout.offs_data + sizes.data, 4);
+   return layout;
+}
+
+// Largest alignment asked for by a section inside the segment
+size_t cro_segment_alignment(elfio& elf, int seg_idx)
+{
+   size_t align = 4;
+   segment* seg = elf.segments[seg_idx];
+   for (int i = 0; i < seg->get_sections_num(); i++)
+   {
+      section* sec = elf.sections[seg->get_section_index_at(i)];
+      if (sec->get_addr_align() > align)
+         align = sec->get_addr_align();
+   }
+   
+   return align;
+}
+
+// Address order, segment first
+bool cro_reloc_less(const CRO_Relocation& a, const CRO_Relocation& b)
+{
+   if ((a.seg_offset & 0xF) != (b.seg_offset & 0xF))
+      return (a.seg_offset & 0xF) < (b.seg_offset & 0xF);
+   return (a.seg_offset >> 4) < (b.seg_offset >> 4);
+}
+
+// Address order, then the rest of the entry so identical ones end up adjacent
+bool cro_reloc_full_less(const CRO_Relocation& a, const CRO_Relocation& b)
+{
+   if (cro_reloc_less(a, b) || cro_reloc_less(b, a))
+      return cro_reloc_less(a, b);
+   if (a.type != b.type)
+      return a.type < b.type;
+   if (a.addend != b.addend)
+      return a.addend < b.addend;
+   return a.last_entry < b.last_entry;
+}
+
+bool cro_reloc_equal(const CRO_Relocation& a, const CRO_Relocation& b)
+{
+   return a.seg_offset == b.seg_offset && a.type == b.type && a.last_entry == b.last_entry && a.addend == b.addend;
+}
+
+// Pages the loader writes to while walking a patch table in order
+void cro_print_reloc_stats(const char* name, const CRO_Relocation* relocs, size_t count, const size_t segment_start[5])
+{
+   std::unordered_set<uint64_t> pages;
+   size_t page_switches = 0;
+   uint64_t last_page = ~0ull;
+   for (size_t i = 0; i < count; i++)
+   {
+      uint32_t seg = relocs[i].seg_offset & 0xF;
+      uint32_t offset = relocs[i].seg_offset >> 4;
+      
+      // .data and .bss are copied to their own buffers when loaded
+      uint64_t page;
+      if (seg == SEG_DATA || seg == SEG_BSS)
+         page = ((uint64_t)seg << 32) | (offset >> 12);
+      else
+         page = (segment_start[seg] + offset) >> 12;
+      
+      pages.insert(page);
+      if (page != last_page)
+         page_switches++;
+      last_page = page;
+   }
+   
+   printf("%s: %zu entries, %zu distinct pages, %zu page switches\n", name, count, pages.size(), page_switches);
+}
+
 uint32_t cro_addr_to_segment(elfio& elf, Elf64_Addr addr)
 {
+   tool_stats_count(STAT_SEGMENT_LOOKUPS);
    int seg_idx = -1;
    for (int i = 0; i < elf.segments.size(); i++)
    {
@@ -77,22 +261,387 @@ uint32_t cro_addr_to_segment_addr(elfio& elf, Elf64_Addr addr)
 
 void ELF_get_symbol(symbol_section_accessor& syma, int index, ELF_Symbol& symbol_out)
 {
+   tool_stats_count(STAT_SYMBOLS);
    syma.get_symbol(index, symbol_out.name, symbol_out.addr, symbol_out.size, symbol_out.bind, symbol_out.type, symbol_out.section_index, symbol_out.other);
 }
 
+// Reads a list of symbol names, one per line with an optional weight after
+// the name. When weights are given (e.g. reference counts from a profile),
+// the heaviest symbols get the lowest indexes.
+bool load_symbol_list(const char* path, std::vector<std::string>& names_out)
+{
+   std::ifstream file(path);
+   if (!file.is_open())
+      return false;
+
+   std::vector<std::pair<std::string, double> > entries;
+   std::string line;
+   while (std::getline(file, line))
+   {
+      size_t start = line.find_first_not_of(" \t\r");
+      if (start == std::string::npos || line[start] == '#') continue;
+
+      size_t end = line.find_first_of(" \t\r", start);
+      std::string name = line.substr(start, end - start);
+      double weight = 0;
+      if (end != std::string::npos)
+         weight = strtod(line.c_str() + end, NULL);
+
+      entries.push_back(std::make_pair(name, weight));
+   }
+
+   std::stable_sort(entries.begin(), entries.end(), [](const std::pair<std::string, double>& a, const std::pair<std::string, double>& b) {
+      return a.second > b.second;
+   });
+
+   for (const auto& entry : entries)
+      names_out.push_back(entry.first);
+
+   return true;
+}
+
+int cro_find_import_module(std::vector<CRO_ImportModule>& modules, const std::string& name)
+{
+   for (int i = 0; i < modules.size(); i++)
+   {
+      if (modules[i].name == name)
+         return i;
+   }
+
+   CRO_ImportModule module;
+   module.name = name;
+   modules.push_back(module);
+   return modules.size() - 1;
+}
+
+// Index imports win over offset imports from the same module, a name
+// exported by two different modules is left to global named resolution.
+void module_map_add(CRO_ModuleMap& map, const std::string& module_name, const std::string& name, uint8_t kind, uint32_t value)
+{
+   if (module_name == map.self_name) return;
+   
+   int module = cro_find_import_module(map.modules, module_name);
+   auto it = map.symbols.find(name);
+   if (it == map.symbols.end())
+      map.symbols[name] = CRO_ModuleSymbol{module, kind, value};
+   else if (it->second.module == module && kind == SYM_INDEX_IMPORT)
+      it->second = CRO_ModuleSymbol{module, kind, value};
+   else if (it->second.module != module)
+      it->second.module = -1;
+}
+
+// cro2elf names index exports export_index_<n>, and index imports
+// import_index_<module>_<n>, so converted CROs keep their indexes.
+bool parse_index_symbol_name(const std::string& name, const char* prefix, uint32_t& index_out)
+{
+   if (name.compare(0, strlen(prefix), prefix) != 0) return false;
+   if (name.size() == strlen(prefix)) return false;
+   
+   char* end;
+   index_out = strtoul(name.c_str() + strlen(prefix), &end, 10);
+   return *end == '\0';
+}
+
+bool parse_index_import_name(const std::string& name, std::string& module_out, uint32_t& index_out)
+{
+   const char* prefix = "import_index_";
+   if (name.compare(0, strlen(prefix), prefix) != 0) return false;
+
+   size_t split = name.find_last_of('_');
+   if (split <= strlen(prefix) || split + 1 == name.size()) return false;
+
+   char* end;
+   index_out = strtoul(name.c_str() + split + 1, &end, 10);
+   module_out = name.substr(strlen(prefix), split - strlen(prefix));
+   return *end == '\0';
+}
+
+// ...and offset imports offset_import_<module>_<segment>_<offset>, in hex
+bool parse_offset_import_name(const std::string& name, std::string& module_out, uint32_t& seg_offset_out)
+{
+   const char* prefix = "offset_import_";
+   if (name.compare(0, strlen(prefix), prefix) != 0) return false;
+
+   size_t split_offs = name.find_last_of('_');
+   if (split_offs == std::string::npos || split_offs <= strlen(prefix)) return false;
+   size_t split_seg = name.find_last_of('_', split_offs - 1);
+   if (split_seg == std::string::npos || split_seg <= strlen(prefix)) return false;
+
+   char* end_seg;
+   char* end_offs;
+   uint32_t seg = strtoul(name.c_str() + split_seg + 1, &end_seg, 16);
+   uint32_t offs = strtoul(name.c_str() + split_offs + 1, &end_offs, 16);
+   if (end_seg != name.c_str() + split_offs || *end_offs != '\0' || end_offs == name.c_str() + split_offs + 1) return false;
+
+   module_out = name.substr(strlen(prefix), split_seg - strlen(prefix));
+   seg_offset_out = (offs << 4) | (seg & 0xf);
+   return true;
+}
+
+bool load_file(const char* path, std::vector<char>& data_out)
+{
+   FILE* file = fopen(path, "rb");
+   if (!file)
+      return false;
+
+   fseek(file, 0, SEEK_END);
+   data_out.resize(ftell(file));
+   fseek(file, 0, SEEK_SET);
+   size_t read = fread(data_out.data(), sizeof(uint8_t), data_out.size(), file);
+   fclose(file);
+
+   return read == data_out.size();
+}
+
+// Every named export of a provider CRO can be imported anonymously by its
+// segment offset instead of by name.
+bool module_map_load_cro(CRO_ModuleMap& map, const char* path)
+{
+   std::vector<char> cro_data;
+   if (!load_file(path, cro_data) || cro_data.size() < sizeof(CRO_Header))
+      return false;
+
+   CRO_Header* cro_header = (CRO_Header*)cro_data.data();
+   if (cro_header->magic != MAGIC_CRO0)
+      return false;
+
+   std::string module_name = cro_header->get_name(cro_data.data());
+   for (int i = 0; i < cro_header->num_symbol_exports; i++)
+   {
+      CRO_Symbol* symbol = cro_header->get_export(cro_data.data(), i);
+      module_map_add(map, module_name, (char*)cro_data.data() + symbol->offs_name, SYM_OFFSET_IMPORT, symbol->seg_offset);
+   }
+
+   return true;
+}
+
+// A crotool index has the named exports of every CRO it was built from
+bool module_map_load_cro_index(CRO_ModuleMap& map, const char* path)
+{
+   std::vector<char> index_data;
+   if (!load_file(path, index_data) || !cro_index_is_valid(index_data.data(), index_data.size()))
+      return false;
+
+   const CRO_Index_Header* index_header = (const CRO_Index_Header*)index_data.data();
+   for (uint32_t m = 0; m < index_header->num_modules; m++)
+   {
+      const CRO_Index_Module* module = index_header->get_module(index_data.data(), m);
+      std::string module_name = index_header->get_string(index_data.data(), module->offs_name);
+      for (uint32_t i = module->first_export; i < module->first_export + module->num_exports; i++)
+      {
+         const CRO_Index_Export* symbol = index_header->get_export(index_data.data(), i);
+         module_map_add(map, module_name, index_header->get_string(index_data.data(), symbol->offs_name), SYM_OFFSET_IMPORT, symbol->seg_offset);
+      }
+   }
+
+   return true;
+}
+
+bool module_map_load_index_list(CRO_ModuleMap& map, const std::string& module_name, const char* path)
+{
+   std::vector<std::string> names;
+   if (!load_symbol_list(path, names))
+      return false;
+   
+   cro_find_import_module(map.modules, module_name);
+   for (int i = 0; i < names.size(); i++)
+      module_map_add(map, module_name, names[i], SYM_INDEX_IMPORT, i);
+
+   return true;
+}
+
+// Manifest lines are either
+//    <module> <symbol> <segment> <offset, hex>
+//    <module> <symbol> index <n>
+bool module_map_load_manifest(CRO_ModuleMap& map, const char* path)
+{
+   std::ifstream file(path);
+   if (!file.is_open())
+      return false;
+
+   std::string line;
+   while (std::getline(file, line))
+   {
+      char module_name[256], name[1024], location[32], value[32];
+      if (line.empty() || line[0] == '#') continue;
+      if (sscanf(line.c_str(), "%255s %1023s %31s %31s", module_name, name, location, value) != 4)
+      {
+         printf("Bad manifest line: %s\n", line.c_str());
+         return false;
+      }
+      
+      if (!strcmp(location, "index"))
+         module_map_add(map, module_name, name, SYM_INDEX_IMPORT, strtoul(value, NULL, 10));
+      else
+         module_map_add(map, module_name, name, SYM_OFFSET_IMPORT, (strtoul(value, NULL, 16) << 4) | (strtoul(location, NULL, 10) & 0xf));
+   }
+
+   return true;
+}
+
+// Loads every .cro/.crs in a directory, a single CRO, a crotool index, or a
+// text manifest
+bool module_map_load(CRO_ModuleMap& map, const char* path)
+{
+   struct stat path_stat;
+   if (stat(path, &path_stat) != 0)
+      return false;
+
+   if (S_ISDIR(path_stat.st_mode))
+   {
+      DIR* dir = opendir(path);
+      if (!dir)
+         return false;
+      
+      std::vector<std::string> files;
+      struct dirent* entry;
+      while ((entry = readdir(dir)) != NULL)
+      {
+         std::string file_name = entry->d_name;
+         if (file_name.size() < 4) continue;
+         
+         std::string extension = file_name.substr(file_name.size() - 4);
+         if (extension == ".cro" || extension == ".crs")
+            files.push_back(std::string(path) + "/" + file_name);
+      }
+      closedir(dir);
+      
+      // Directory order is arbitrary, keep module numbering reproducible
+      std::sort(files.begin(), files.end());
+      for (const auto& file : files)
+      {
+         if (!module_map_load_cro(map, file.c_str()))
+         {
+            printf("Failed to load CRO %s!\n", file.c_str());
+            return false;
+         }
+      }
+      return true;
+   }
+
+   uint32_t magic = 0, index_magic = 0;
+   FILE* file = fopen(path, "rb");
+   if (!file)
+      return false;
+   fread(&index_magic, sizeof(index_magic), 1, file);
+   fseek(file, offsetof(CRO_Header, magic), SEEK_SET);
+   fread(&magic, sizeof(magic), 1, file);
+   fclose(file);
+
+   if (magic == MAGIC_CRO0)
+      return module_map_load_cro(map, path);
+   if (index_magic == MAGIC_CRX0)
+      return module_map_load_cro_index(map, path);
+   return module_map_load_manifest(map, path);
+}
+
+void print_usage(char* name)
+{
+   printf("Usage: %s [options] <input.elf> <output.cro>\n", name);
+   printf("Options:\n");
+   printf("  --index-exports <list.txt>          Export the listed symbols by index\n");
+   printf("  --index-imports <module>=<list.txt> Import symbols in <module>'s index export list by index\n");
+   printf("                                      (the same list <module> was built with)\n");
+   printf("  --offset-imports <provider.cro>     Import <provider.cro>'s named exports by segment offset\n");
+   printf("  --modules <dir|index|manifest>      Group imports by the module exporting them, using every\n");
+   printf("                                      CRO in <dir>, a crotool index or a manifest of\n");
+   printf("                                      <module> <symbol> <location>\n");
+   printf("  --compact                           Only page align the end of the code region and pack the\n");
+   printf("                                      export tables into its padding\n");
+   printf("  --dedup-static                      Drop identical static relocations\n");
+   printf("  --reloc-stats                       Report the pages each patch table touches\n");
+   printf("  --stats[=<file.json>]               Dump phase timings and counters as JSON\n");
+}
+
 int main(int argc, char **argv)
 {
-   if (argc < 3)
+   Tool_Stats_Report stats_report("elf2cro", tool_stats_parse_args(argc, argv));
+   Tool_Phase phase("parse options");
+   
+   std::vector<std::string> index_export_names;
+   std::vector<std::pair<std::string, const char*> > module_specs; // (option, path)
+   std::vector<char*> args;
+   bool compact_layout = false;
+   bool dedup_static = false;
+   bool reloc_stats = false;
+   for (int i = 1; i < argc; i++)
    {
-      printf("Usage: %s <input.elf> <output.cro>\n", argv[0]);
+      if (!strcmp(argv[i], "--compact"))
+         compact_layout = true;
+      else if (!strcmp(argv[i], "--dedup-static"))
+         dedup_static = true;
+      else if (!strcmp(argv[i], "--reloc-stats"))
+         reloc_stats = true;
+      else if (!strcmp(argv[i], "--index-exports") && i + 1 < argc)
+      {
+         if (!load_symbol_list(argv[++i], index_export_names))
+         {
+            printf("Failed to load index export list %s! Exiting...\n", argv[i]);
+            return -1;
+         }
+      }
+      else if ((!strcmp(argv[i], "--index-imports") || !strcmp(argv[i], "--offset-imports") || !strcmp(argv[i], "--modules")) && i + 1 < argc)
+      {
+         module_specs.push_back(std::make_pair(std::string(argv[i]), argv[i + 1]));
+         i++;
+      }
+      else
+         args.push_back(argv[i]);
+   }
+
+   if (args.size() < 2)
+   {
+      print_usage(argv[0]);
       return -1;
    }
+   
+   const char* input_path = args[0];
+   const char* output_path = args[1];
+   
+   std::string cro_filename = std::string(output_path);
+   std::string cro_name = cro_filename.substr(0, cro_filename.find_last_of("."));
+   
+   // Modules we could import from, never ourselves
+   phase.next("load modules");
+   CRO_ModuleMap module_map;
+   module_map.self_name = cro_name;
+   for (const auto& spec : module_specs)
+   {
+      bool loaded;
+      if (spec.first == "--index-imports")
+      {
+         const char* list = strchr(spec.second, '=');
+         if (!list)
+         {
+            print_usage(argv[0]);
+            return -1;
+         }
+         loaded = module_map_load_index_list(module_map, std::string(spec.second, list - spec.second), list + 1);
+      }
+      else if (spec.first == "--offset-imports")
+         loaded = module_map_load_cro(module_map, spec.second);
+      else
+         loaded = module_map_load(module_map, spec.second);
+
+      if (!loaded)
+      {
+         printf("Failed to load %s %s! Exiting...\n", spec.first.c_str(), spec.second);
+         return -1;
+      }
+   }
+   std::vector<CRO_ImportModule>& import_modules = module_map.modules;
 
+   phase.next("load elf");
    elfio elf;
    
-   if (!elf.load(argv[1]))
+   // Debug info and other sections the CRO doesn't carry are never read
+   elf.set_lazy_load(true);
+   elf.add_preload_type(SHT_DYNSYM);
+   elf.add_preload_type(SHT_REL);
+   elf.add_preload_type(SHT_RELA);
+   if (!elf.load(input_path))
    {
-      printf("Failed to load file %s! Exiting...\n", argv[1]);
+      printf("Failed to load file %s! Exiting...\n", input_path);
       return -1;
    }
    
@@ -102,11 +651,280 @@ int main(int argc, char **argv)
    cro_ctx.cro_header = (CRO_Header*)cro_ctx.cro_data;
    
    
+   // Push exported symbols
+   phase.next("classify symbols");
+   symbol_section_accessor syma(elf, elf.sections[".dynsym"]);
+   tool_stats_count(STAT_SECTION_LOOKUPS);
+   
+   size_t count_exports = 0;
+   size_t count_imports = 0;
+   size_t count_index_imports = 0;
+   size_t count_offset_imports = 0;
+   size_t count_ambiguous_imports = 0;
+   size_t export_strtab_size = 0;
+   size_t import_strtab_size = 0;
+   std::vector<uint8_t> symbol_kinds(syma.get_symbols_num(), SYM_SKIP);
+   std::vector<int> index_export_symbols;
+   std::unordered_map<std::string, Elf_Word> export_symbols;
+   for (int i = 0; i < syma.get_symbols_num(); i++)
+   {
+      ELF_Symbol symbol;
+      ELF_get_symbol(syma, i, symbol);
+      
+      if (symbol.name == "") continue;
+      
+      std::string module_name;
+      uint32_t index;
+      if (symbol.section_index != 0)
+      {
+         if (parse_index_symbol_name(symbol.name, "export_index_", index))
+         {
+            if (index >= index_export_symbols.size())
+               index_export_symbols.resize(index + 1, -1);
+            index_export_symbols[index] = i;
+            continue;
+         }
+         
+         // cro2elf also emits a defined import_index_<n> alias for each index export
+         if (parse_index_symbol_name(symbol.name, "import_index_", index)) continue;
+         
+         symbol_kinds[i] = SYM_EXPORT;
+         count_exports++;
+         export_strtab_size += symbol.name.length() + 1;
+         
+         if (!index_export_names.empty())
+            export_symbols[symbol.name] = i;
+      }
+      else if (parse_index_import_name(symbol.name, module_name, index))
+      {
+         int module = cro_find_import_module(import_modules, module_name);
+         import_modules[module].index_imports.push_back(std::make_pair(index, (Elf_Word)i));
+         symbol_kinds[i] = SYM_INDEX_IMPORT;
+         count_index_imports++;
+      }
+      else if (parse_offset_import_name(symbol.name, module_name, index))
+      {
+         int module = cro_find_import_module(import_modules, module_name);
+         import_modules[module].offset_imports.push_back(std::make_pair(index, (Elf_Word)i));
+         symbol_kinds[i] = SYM_OFFSET_IMPORT;
+         count_offset_imports++;
+      }
+      else if (module_map.symbols.find(symbol.name) != module_map.symbols.end() && module_map.symbols[symbol.name].module != -1)
+      {
+         const CRO_ModuleSymbol& module_symbol = module_map.symbols[symbol.name];
+         symbol_kinds[i] = module_symbol.kind;
+         if (module_symbol.kind == SYM_INDEX_IMPORT)
+         {
+            import_modules[module_symbol.module].index_imports.push_back(std::make_pair(module_symbol.value, (Elf_Word)i));
+            count_index_imports++;
+         }
+         else
+         {
+            import_modules[module_symbol.module].offset_imports.push_back(std::make_pair(module_symbol.value, (Elf_Word)i));
+            count_offset_imports++;
+         }
+      }
+      else
+      {
+         if (module_map.symbols.find(symbol.name) != module_map.symbols.end())
+            count_ambiguous_imports++;
+         
+         symbol_kinds[i] = SYM_IMPORT;
+         count_imports++;
+         import_strtab_size += symbol.name.length() + 1;
+      }
+   }
+   
+   // Listed index exports take the slot matching their position in the list
+   for (int i = 0; i < index_export_names.size(); i++)
+   {
+      if (export_symbols.find(index_export_names[i]) == export_symbols.end())
+      {
+         printf("Index export %s is not exported by %s! Exiting...\n", index_export_names[i].c_str(), input_path);
+         return -1;
+      }
+      
+      if (i >= index_export_symbols.size())
+         index_export_symbols.resize(i + 1, -1);
+      if (index_export_symbols[i] != -1)
+      {
+         printf("Index export %u is defined twice! Exiting...\n", i);
+         return -1;
+      }
+      index_export_symbols[i] = export_symbols[index_export_names[i]];
+   }
+   
+   for (int i = 0; i < index_export_symbols.size(); i++)
+   {
+      if (index_export_symbols[i] == -1)
+      {
+         printf("Index export %u has no symbol! Exiting...\n", i);
+         return -1;
+      }
+   }
+   
+   // Export tree entries link to each other through 15 bit indices
+   if (count_exports > export_trie::max_keys)
+   {
+      printf("Too many exports for the export tree (max 0x%zx)\n", export_trie::max_keys);
+      return -1;
+   }
+   
+   // Only modules we actually import from get a module entry
+   for (int i = 0; i < import_modules.size(); i++)
+   {
+      if (import_modules[i].index_imports.empty() && import_modules[i].offset_imports.empty())
+      {
+         import_modules.erase(import_modules.begin() + i--);
+         continue;
+      }
+      
+      std::sort(import_modules[i].index_imports.begin(), import_modules[i].index_imports.end());
+      std::sort(import_modules[i].offset_imports.begin(), import_modules[i].offset_imports.end());
+      import_strtab_size += import_modules[i].name.length() + 1;
+   }
+   
+   if (!module_specs.empty() || !import_modules.empty())
+   {
+      printf("Grouped %zu imports under %zu modules, %zu fell back to named resolution (%zu exported by several modules)\n",
+             count_index_imports + count_offset_imports, import_modules.size(), count_imports, count_ambiguous_imports);
+      for (const auto& module : import_modules)
+         printf("   %s: %zu index, %zu offset\n", module.name.c_str(), module.index_imports.size(), module.offset_imports.size());
+   }
+   
+   // Push import data
+   
+   // Convert relocations, import patches are chained per symbol once the
+   // table is placed
+   phase.next("convert relocations");
+   std::vector<std::pair<Elf_Word, CRO_Relocation> > import_patches; // (dynsym index, patch)
+   std::vector<CRO_Relocation> static_patches;
+   std::vector<std::pair<int, uint32_t> > relative_targets; // (segment, offset)
+
+   for (int k = 0; k < elf.sections.size(); k++)
+   {
+      section* sec = elf.sections[k];
+      tool_stats_count(STAT_SECTION_LOOKUPS);
+      if (sec->get_type() != SHT_RELA && sec->get_type() != SHT_REL) continue;
+
+      relocation_section_accessor rela(elf, sec);
+      tool_stats_count(STAT_RELOCS, rela.get_entries_num());
+      for (int i = 0; i < rela.get_entries_num(); i++)
+      {
+         Elf64_Addr offset = 0;
+         Elf_Word symbol_idx = 0;
+         Elf_Word relType = 0;
+         Elf_Sxword addend = 0;
+
+         rela.get_entry(i, offset, symbol_idx, relType, addend);
+         
+         ELF_Symbol symbol;
+         ELF_get_symbol(syma, symbol_idx, symbol);
+         
+         if (symbol.section_index == 0 && symbol.name != "")
+         {
+            CRO_Relocation patch = {};
+            patch.seg_offset = cro_addr_to_segment_addr(elf, offset);
+            patch.type = relType;
+            patch.addend = addend;
+            import_patches.push_back(std::make_pair(symbol_idx, patch));
+         }
+         else
+         {
+            int sym_seg = cro_addr_to_segment(elf, symbol.addr);
+            int sym_add = 0;
+            if (sym_seg == -1)
+               sym_seg = 0;
+            else
+               sym_add = symbol.addr - elf.segments[sym_seg]->get_virtual_address();
+            //printf("%x %x %x\n", sym_seg, sym_add, symbol.addr);
+            
+            if (relType == 0x15)
+               relType = 2;
+               
+            if (relType == 0x17)
+            {
+               int offs_seg = cro_addr_to_segment(elf, offset);
+               int offs_addr = elf.segments[offs_seg]->get_virtual_address();
+               int offs_add = offset - offs_addr;
+               const char* seg_data = elf.segments[offs_seg]->get_data();
+               
+               // The CRO copy of the target is cleared once it's written
+               uint32_t val_to_change = *(uint32_t*)(seg_data + offs_add);
+               relative_targets.push_back(std::make_pair(offs_seg, (uint32_t)offs_add));
+               
+               // Adjust the existing value and find the segment
+               offs_seg = cro_addr_to_segment(elf, val_to_change);
+               offs_addr = elf.segments[offs_seg]->get_virtual_address();
+               
+               val_to_change -= offs_addr;
+               addend += val_to_change;
+               sym_add = val_to_change;
+               sym_seg = offs_seg;
+               
+               //printf("%x (seg %x) %x+%x %x\n", offset, offs_seg, offs_addr, offs_add, val_to_change);
+               
+               relType = 2;
+            }
+
+            CRO_Relocation patch = {};
+            patch.seg_offset = cro_addr_to_segment_addr(elf, offset);
+            patch.type = relType;
+            patch.last_entry = sym_seg;
+            if (sec->get_type() == SHT_RELA)
+               patch.addend = addend - symbol.addr;
+            else
+               patch.addend = sym_add;
+            
+            static_patches.push_back(patch);
+         }
+      }
+   }
+   
+   // Static relocations are applied in table order, walking them by
+   // address keeps the loader on one page at a time
+   std::stable_sort(static_patches.begin(), static_patches.end(), dedup_static ? cro_reloc_full_less : cro_reloc_less);
+   if (dedup_static)
+   {
+      size_t count_before = static_patches.size();
+      static_patches.erase(std::unique(static_patches.begin(), static_patches.end(), cro_reloc_equal), static_patches.end());
+      printf("Removed %zu duplicate static relocations\n", count_before - static_patches.size());
+   }
+   
+   size_t import_relocs_count = import_patches.size();
+   size_t export_relocs_count = static_patches.size();
+   
+   // Lay out the file now that every table size is known
+   phase.next("layout");
+   CRO_LayoutSizes layout_sizes;
+   layout_sizes.text = elf.segments[SEG_TEXT]->get_file_size();
+   layout_sizes.rodata = elf.segments[SEG_RODATA]->get_file_size();
+   layout_sizes.rodata_align = cro_segment_alignment(elf, SEG_RODATA);
+   layout_sizes.export_tables = align_up(cro_name.size() + 1, 4)
+                              + sizeof(CRO_Segment) * 5
+                              + sizeof(CRO_Symbol) * count_exports
+                              + sizeof(CRO_ExportTreeEntry) * count_exports
+                              + sizeof(CRO_Symbol) * index_export_symbols.size()
+                              + align_up(export_strtab_size, 4);
+   layout_sizes.import_tables = sizeof(CRO_ModuleEntry) * import_modules.size()
+                              + sizeof(CRO_Relocation) * import_relocs_count
+                              + sizeof(CRO_Symbol) * (count_imports + count_index_imports + count_offset_imports)
+                              + align_up(import_strtab_size, 4)
+                              + sizeof(CRO_Relocation) * export_relocs_count;
+   layout_sizes.data = elf.segments[SEG_DATA]->get_file_size();
+   layout_sizes.data_align = cro_segment_alignment(elf, SEG_DATA);
+   
+   CRO_Layout layout = cro_plan_layout(layout_sizes, compact_layout);
+   if (compact_layout)
+   {
+      size_t standard_size = cro_plan_layout(layout_sizes, false).size_file;
+      printf("Compact layout saves 0x%zx bytes (0x%zx -> 0x%zx)\n", standard_size - layout.size_file, standard_size, layout.size_file);
+   }
+   
+   phase.next("write segments");
    size_t segment_start[5];
-   size_t segment_size[5];
    
    cro_align_up(cro_ctx, 0x80);
-   size_t cro_header_size = cro_ctx.cro_size;
 
    cro_ctx.cro_header->magic = MAGIC_CRO0;
    
@@ -115,26 +933,20 @@ int main(int argc, char **argv)
    push_segment(cro_ctx, elf.segments[SEG_TEXT]);
    
    // Push .rodata segment
-   cro_align_up(cro_ctx, 0x1000);
+   cro_pad_to(cro_ctx, layout.offs_rodata);
    segment_start[SEG_RODATA] = cro_ctx.cro_size;
-   segment_size[SEG_TEXT] = cro_ctx.cro_size - segment_start[SEG_TEXT];
    push_segment(cro_ctx, elf.segments[SEG_RODATA]);
-   segment_size[SEG_RODATA] = cro_ctx.cro_size - segment_start[SEG_RODATA];
-   cro_align_up(cro_ctx, 0x1000);
-   size_t text_total_size = cro_ctx.cro_size - segment_start[SEG_TEXT];
+   size_t text_total_size = layout.code_end - segment_start[SEG_TEXT];
    
    // Set .bss size
    segment_start[SEG_BSS] = 0;
-   segment_size[SEG_BSS] = elf.segments[SEG_BSS]->get_memory_size();
 
    //
    // Begin linking info
    //
    
    // Push CRO module name
-   std::string cro_filename = std::string(argv[2]);
-   std::string cro_name = cro_filename.substr(0, cro_filename.find_last_of("."));
-   
+   cro_pad_to(cro_ctx, layout.offs_export_tables);
    cro_ctx.cro_header->offs_mod_name = cro_ctx.cro_size;
    cro_ctx.cro_header->offs_name = cro_ctx.cro_size;
    cro_ctx.cro_header->size_name = cro_name.size() + 1;
@@ -148,32 +960,6 @@ int main(int argc, char **argv)
    cro_ctx.cro_header->num_segments = 5; //TODO?
    push_data(cro_ctx, NULL, sizeof(CRO_Segment) * cro_ctx.cro_header->num_segments);
    
-   // Push exported symbols
-   symbol_section_accessor syma(elf, elf.sections[".dynsym"]);
-   
-   size_t count_exports = 0;
-   size_t count_imports = 0;
-   size_t export_strtab_size = 0;
-   size_t import_strtab_size = 0;
-   for (int i = 0; i < syma.get_symbols_num(); i++)
-   {
-      ELF_Symbol symbol;
-      ELF_get_symbol(syma, i, symbol);
-      
-      if (symbol.name == "") continue;
-      
-      if (symbol.section_index != 0)
-      {
-         count_exports++;
-         export_strtab_size += symbol.name.length() + 1;
-      }
-      else
-      {
-         count_imports++;
-         import_strtab_size += symbol.name.length() + 1;
-      }
-   }
-   
    // Push symbol exports
    cro_ctx.cro_header->offs_symbol_exports = cro_ctx.cro_size;
    cro_ctx.cro_header->num_symbol_exports = count_exports;
@@ -184,9 +970,10 @@ int main(int argc, char **argv)
    cro_ctx.cro_header->num_export_tree = count_exports;
    push_data(cro_ctx, NULL, sizeof(CRO_ExportTreeEntry) * count_exports);
 
-   // Push index exports (TODO)
+   // Push index exports
    cro_ctx.cro_header->offs_index_exports = cro_ctx.cro_size;
-   cro_ctx.cro_header->num_index_exports = 0;
+   cro_ctx.cro_header->num_index_exports = index_export_symbols.size();
+   push_data(cro_ctx, NULL, sizeof(CRO_Symbol) * index_export_symbols.size());
 
    // Push export strtab
    size_t export_strtab_offset = cro_ctx.cro_size;
@@ -202,42 +989,12 @@ int main(int argc, char **argv)
    cro_ctx.cro_header->size_export_strtab = export_strtab_size;
    cro_align_up(cro_ctx, 0x4);
    
-   // Push import data
-   
-   // Count up allocations
-   
-   size_t import_relocs_count = 0;
-   size_t export_relocs_count = 0;
+   cro_pad_to(cro_ctx, layout.offs_import_tables);
    
-   // Count relocs
-
-   for (int k = 0; k < elf.sections.size(); k++)
-   {
-      section* sec = elf.sections[k];
-      if (sec->get_type() != SHT_RELA && sec->get_type() != SHT_REL) continue;
-      
-      relocation_section_accessor rela(elf, sec);
-      for (int i = 0; i < rela.get_entries_num(); i++)
-      {
-         Elf64_Addr offset;
-         Elf_Word symbol_idx;
-         Elf_Word relType;
-         Elf_Sxword addend;
-
-         rela.get_entry(i, offset, symbol_idx, relType, addend);
-            
-         ELF_Symbol symbol;
-         ELF_get_symbol(syma, symbol_idx, symbol);
-         
-         if (symbol.section_index == 0 && symbol.name != "")
-            import_relocs_count++;
-         else
-            export_relocs_count++;
-      }
-   }
-   
-   // Import modules (TODO)
+   // Import modules
    cro_ctx.cro_header->offs_import_module = cro_ctx.cro_size;
+   cro_ctx.cro_header->num_import_module = import_modules.size();
+   push_data(cro_ctx, NULL, sizeof(CRO_ModuleEntry) * import_modules.size());
    
    // Import patches
    cro_ctx.cro_header->offs_import_patches = cro_ctx.cro_size;
@@ -249,11 +1006,15 @@ int main(int argc, char **argv)
    cro_ctx.cro_header->num_symbol_imports = count_imports;
    push_data(cro_ctx, NULL, sizeof(CRO_Symbol) * count_imports);
    
-   // Import indexes (TODO)
+   // Import indexes
    cro_ctx.cro_header->offs_index_imports = cro_ctx.cro_size;
+   cro_ctx.cro_header->num_index_imports = count_index_imports;
+   push_data(cro_ctx, NULL, sizeof(CRO_Symbol) * count_index_imports);
    
-   // Import offset imports (TODO)
+   // Import offset imports
    cro_ctx.cro_header->offs_offset_imports = cro_ctx.cro_size;
+   cro_ctx.cro_header->num_offset_imports = count_offset_imports;
+   push_data(cro_ctx, NULL, sizeof(CRO_Symbol) * count_offset_imports);
    
    // Import strtab
    cro_ctx.cro_header->offs_import_strtab = cro_ctx.cro_size;
@@ -261,8 +1022,10 @@ int main(int argc, char **argv)
    push_data(cro_ctx, NULL, import_strtab_size);
    cro_align_up(cro_ctx, 0x4);
    
-   // Export offsets (TODO)
+   // Export offsets, the anonymous symbols the static module imports from us.
+   // Nothing in the ELF describes those, so the table is always empty.
    cro_ctx.cro_header->offs_offset_exports = cro_ctx.cro_size;
+   cro_ctx.cro_header->num_offset_exports = 0;
    
    // Export unk (TODO?)
    cro_ctx.cro_header->offs_unk = cro_ctx.cro_size;
@@ -273,105 +1036,61 @@ int main(int argc, char **argv)
    push_data(cro_ctx, NULL, sizeof(CRO_Relocation) * export_relocs_count);
 
    // Push data
+   cro_pad_to(cro_ctx, layout.offs_data);
    segment_start[SEG_DATA] = cro_ctx.cro_size;
    push_segment(cro_ctx, elf.segments[SEG_DATA]);
    cro_ctx.cro_header->size_data = cro_ctx.cro_size - segment_start[SEG_DATA];
-   cro_align_up(cro_ctx, 0x1000, 0xCC);
-   segment_size[SEG_DATA] = cro_ctx.cro_size - segment_start[SEG_DATA];
+   cro_pad_to(cro_ctx, layout.size_file, 0xCC);
 
    // Write import/export patches
-   size_t import_reloc_count = 0;
-   size_t static_reloc_count = 0;
+   phase.next("write patches");
    CRO_Relocation* import_relocs = (CRO_Relocation*)((char*)cro_ctx.cro_data + cro_ctx.cro_header->offs_import_patches);
    CRO_Relocation* static_relocs = (CRO_Relocation*)((char*)cro_ctx.cro_data + cro_ctx.cro_header->offs_static_relocations);
-   std::map<Elf_Word, int> symbol_to_patches;
-
-   Elf_Word last_import_symbol_idx;
-   for (int k = 0; k < elf.sections.size(); k++)
+   if (!static_patches.empty())
+      memcpy(static_relocs, static_patches.data(), sizeof(CRO_Relocation) * static_patches.size());
+   for (const auto& target : relative_targets)
+      *(uint32_t*)((char*)cro_ctx.cro_data + segment_start[target.first] + target.second) = 0;
+   
+   // The loader walks one run of patches per import, ending at last_entry.
+   // Counting sort on the symbol index gives every import a single chain
+   // however the ELF interleaves its relocations.
+   std::vector<int> import_chain_start(syma.get_symbols_num() + 1, 0);
+   for (const auto& patch : import_patches)
+      import_chain_start[patch.first + 1]++;
+   for (int i = 0; i < syma.get_symbols_num(); i++)
+      import_chain_start[i + 1] += import_chain_start[i];
+   
+   std::vector<int> import_chain_next(import_chain_start.begin(), import_chain_start.end() - 1);
+   for (const auto& patch : import_patches)
+      import_relocs[import_chain_next[patch.first]++] = patch.second;
+   
+   for (int i = 0; i < syma.get_symbols_num(); i++)
    {
-      section* sec = elf.sections[k];
-      if (sec->get_type() != SHT_RELA && sec->get_type() != SHT_REL) continue;
-
-      relocation_section_accessor rela(elf, sec);
-      for (int i = 0; i < rela.get_entries_num(); i++)
-      {
-         Elf64_Addr offset;
-         Elf_Word symbol_idx;
-         Elf_Word relType;
-         Elf_Sxword addend;
-
-         rela.get_entry(i, offset, symbol_idx, relType, addend);
-         
-         ELF_Symbol symbol;
-         ELF_get_symbol(syma, symbol_idx, symbol);
-         
-         if (symbol.section_index == 0 && symbol.name != "")
-         {
-            import_relocs[import_reloc_count].seg_offset = cro_addr_to_segment_addr(elf, offset);
-            import_relocs[import_reloc_count].type = relType;
-            import_relocs[import_reloc_count].last_entry = 1;
-
-            if (symbol_to_patches[symbol_idx] == 0)
-               symbol_to_patches[symbol_idx] = import_reloc_count;
-
-            if (last_import_symbol_idx == symbol_idx)
-               import_relocs[import_reloc_count-1].last_entry = 0;
-
-            import_relocs[import_reloc_count++].addend = addend;
-
-            last_import_symbol_idx = symbol_idx;
-         }
-         else
-         {
-            int sym_seg = cro_addr_to_segment(elf, symbol.addr);
-            int sym_add = 0;
-            if (sym_seg == -1)
-               sym_seg = 0;
-            else
-               sym_add = symbol.addr - elf.segments[sym_seg]->get_virtual_address();
-            //printf("%x %x %x\n", sym_seg, sym_add, symbol.addr);
-            
-            if (relType == 0x15)
-               relType = 2;
-               
-            if (relType == 0x17)
-            {
-               int offs_seg = cro_addr_to_segment(elf, offset);
-               int offs_addr = elf.segments[offs_seg]->get_virtual_address();
-               int offs_add = offset - offs_addr;
-               void* seg_data = cro_ctx.cro_header->get_segment_data(cro_ctx.cro_data, offs_seg);
-               
-               uint32_t val_to_change = *(uint32_t*)((char*)cro_ctx.cro_data + offs_addr + offs_add);
-               *(uint32_t*)((char*)cro_ctx.cro_data + elf.segments[offs_seg]->get_virtual_address() + offs_add) = 0;
-               
-               // Adjust the existing value and find the segment
-               offs_seg = cro_addr_to_segment(elf, val_to_change);
-               offs_addr = elf.segments[offs_seg]->get_virtual_address();
-               
-               val_to_change -= offs_addr;
-               addend += val_to_change;
-               sym_add = val_to_change;
-               sym_seg = offs_seg;
-               
-               //printf("%x (seg %x) %x+%x %x\n", offset, offs_seg, offs_addr, offs_add, val_to_change);
-               
-               relType = 2;
-            }
-
-            static_relocs[static_reloc_count].seg_offset = cro_addr_to_segment_addr(elf, offset);
-            static_relocs[static_reloc_count].type = relType;
-            static_relocs[static_reloc_count].last_entry = sym_seg;
-            if (sec->get_type() == SHT_RELA)
-               static_relocs[static_reloc_count].addend = addend - symbol.addr;
-            else
-               static_relocs[static_reloc_count].addend = sym_add;
-            
-            static_reloc_count++;
-         }
-      }
+      CRO_Relocation* chain = import_relocs + import_chain_start[i];
+      int chain_size = import_chain_start[i + 1] - import_chain_start[i];
+      
+      std::sort(chain, chain + chain_size, cro_reloc_less);
+      
+      for (int j = 0; j < chain_size; j++)
+         chain[j].last_entry = (j == chain_size - 1);
    }
    
+   if (reloc_stats)
+   {
+      cro_print_reloc_stats("Import patches", import_relocs, import_patches.size(), segment_start);
+      cro_print_reloc_stats("Static relocations", static_relocs, static_patches.size(), segment_start);
+   }
+   
+   // Imports without any patches point nowhere
+   auto import_chain_offset = [&](Elf_Word symbol_idx) -> uint32_t
+   {
+      if (import_chain_start[symbol_idx + 1] == import_chain_start[symbol_idx])
+         return 0;
+      return cro_ctx.cro_header->offs_import_patches + import_chain_start[symbol_idx] * sizeof(CRO_Relocation);
+   };
+   
    // Write symbol exports + index exports + tree
+   phase.next("write symbols");
    size_t export_name_offset = cro_ctx.cro_header->offs_export_strtab;
    size_t import_name_offset = cro_ctx.cro_header->offs_import_strtab;
    size_t export_name_count = 0;
@@ -384,7 +1103,7 @@ int main(int argc, char **argv)
       ELF_Symbol symbol;
       ELF_get_symbol(syma, i, symbol);
       
-      if (symbol.section_index != 0 && symbol.name != "")
+      if (symbol_kinds[i] == SYM_EXPORT)
       {
          //printf("%s %x\n", symbol.name.c_str(), symbol.section_index);
          exportSymbols[export_name_count].offs_name = export_name_offset;
@@ -394,7 +1113,6 @@ int main(int argc, char **argv)
          {
             cro_ctx.cro_header->offs_control = cro_addr_to_segment_addr(elf, symbol.addr);
          }
-         //TODO: export tree
          //TODO: control offset
          //TODO: OnLoad
          //TODO: OnExit
@@ -403,60 +1121,93 @@ int main(int argc, char **argv)
          memcpy((char*)cro_ctx.cro_data + export_name_offset, symbol.name.c_str(), symbol.name.length()+1);
          export_name_offset += symbol.name.length()+1;
       }
-      else if (symbol.section_index == 0 && symbol.name != "")
+      else if (symbol_kinds[i] == SYM_IMPORT)
       {
          //printf("%s %x\n", symbol.name.c_str(), symbol.section_index);
          importSymbols[import_name_count].offs_name = import_name_offset;
-         importSymbols[import_name_count++].seg_offset = cro_ctx.cro_header->offs_import_patches + symbol_to_patches[i] * sizeof(CRO_Relocation);
+         importSymbols[import_name_count++].seg_offset = import_chain_offset(i);
          
          memcpy((char*)cro_ctx.cro_data + import_name_offset, symbol.name.c_str(), symbol.name.length()+1);
          import_name_offset += symbol.name.length()+1;
       }
    }
    
-   // Export Tree
-   std::vector<std::pair<std::string, int> > exportsAndIndexes;
-   for (int i = 0; i < export_name_count; i++)
+   // Index exports are addressed by slot, so they only need the segment offset
+   for (int i = 0; i < index_export_symbols.size(); i++)
    {
-      char* expName = (char*)cro_ctx.cro_data + cro_ctx.cro_header->get_export(cro_ctx.cro_data, i)->offs_name;
-      std::string expNameStr(expName);
-      exportsAndIndexes.push_back(std::pair<std::string, int>(expNameStr, i));
+      ELF_Symbol symbol;
+      ELF_get_symbol(syma, index_export_symbols[i], symbol);
+      
+      CRO_Symbol* index_export = cro_ctx.cro_header->get_index_export(cro_ctx.cro_data, i);
+      index_export->offs_name = i;
+      index_export->seg_offset = cro_addr_to_segment_addr(elf, symbol.addr);
    }
-
+   
+   // Module entries, each pointing at its own run of index and offset imports
+   size_t index_import_count = 0;
+   size_t offset_import_count = 0;
+   for (int i = 0; i < import_modules.size(); i++)
+   {
+      CRO_ImportModule& module = import_modules[i];
+      CRO_ModuleEntry* entry = cro_ctx.cro_header->get_module_entry(cro_ctx.cro_data, i);
+      
+      entry->offs_mod_name = import_name_offset;
+      entry->import_indexed_symbol_table_offset = cro_ctx.cro_header->offs_index_imports + index_import_count * sizeof(CRO_Symbol);
+      entry->import_indexed_symbol_num = module.index_imports.size();
+      entry->import_anonymous_symbol_table_offset = cro_ctx.cro_header->offs_offset_imports + offset_import_count * sizeof(CRO_Symbol);
+      entry->import_anonymous_symbol_num = module.offset_imports.size();
+      
+      memcpy((char*)cro_ctx.cro_data + import_name_offset, module.name.c_str(), module.name.length()+1);
+      import_name_offset += module.name.length()+1;
+      
+      for (const auto& index_import : module.index_imports)
+      {
+         CRO_Symbol* symbol = cro_ctx.cro_header->get_index_import(cro_ctx.cro_data, index_import_count++);
+         symbol->offs_name = index_import.first;
+         symbol->seg_offset = import_chain_offset(index_import.second);
+      }
+      
+      for (const auto& offset_import : module.offset_imports)
+      {
+         CRO_Symbol* symbol = cro_ctx.cro_header->get_offset_import(cro_ctx.cro_data, offset_import_count++);
+         symbol->offs_name = offset_import.first;
+         symbol->seg_offset = import_chain_offset(offset_import.second);
+      }
+   }
+   
+   // Export Tree, keyed by views into the export strtab we just wrote
+   phase.next("export tree");
+   std::vector<string_ref> exportNames;
+   exportNames.reserve(export_name_count);
    std::size_t max_bit_length = 0;
-   for (const auto& pair : exportsAndIndexes)
+   for (int i = 0; i < export_name_count; i++)
    {
-      if (pair.first.size() > max_bit_length)
-         max_bit_length = pair.first.size();
+      const char* expName = (char*)cro_ctx.cro_data + cro_ctx.cro_header->get_export(cro_ctx.cro_data, i)->offs_name;
+      exportNames.push_back(string_ref(expName));
+      
+      if (exportNames.back().size > max_bit_length)
+         max_bit_length = exportNames.back().size;
    }
    max_bit_length *= 8;
 
-   bit_trie<std::string, int, decltype(&string_tester)> example(exportsAndIndexes.begin(), exportsAndIndexes.end(), max_bit_length, &string_tester);
-
-   int treeCount = 0;
-   for (auto& node : example.nodes)
+   if (!exportNames.empty())
    {
-      CRO_ExportTreeEntry* entry = cro_ctx.cro_header->get_export_tree_entry(cro_ctx.cro_data, treeCount);
-      
-      entry->test_bit = static_cast<uint16_t>(node.bit_address) % 8;
-      entry->test_byte = static_cast<uint16_t>(node.bit_address) / 8;
-      entry->left.next_index = node.left.offset + treeCount;
-      entry->left.is_end = node.left.end;
-      entry->right.next_index = node.right.offset + treeCount++;
-      entry->right.is_end = node.right.end;
-      entry->export_index = node.value;
-      
-      if (treeCount == 1)
-         entry->right.is_end = false;
-      
-      //printf("bit %x of byte %04x, %04x %04x \t\t(%s)\n", entry->test_bit, entry->test_byte, entry->left.raw, entry->right.raw, (char*)cro_ctx.cro_data + cro_ctx.cro_header->get_export(cro_ctx.cro_data, entry->export_index)->offs_name);
+      static_assert(sizeof(export_trie::Node) == sizeof(CRO_ExportTreeEntry), "trie nodes must match CRO_ExportTreeEntry");
+
+      export_trie tree(exportNames.begin(), exportNames.end(), max_bit_length, &string_tester);
+
+      // Nodes share the CRO_ExportTreeEntry layout, so they can be copied as-is
+      memcpy(exportTree, tree.nodes.data(), tree.nodes.size() * sizeof(CRO_ExportTreeEntry));
+      exportTree[0].right.is_end = false;
    }
    
    // Finalize
+   phase.next("finalize");
    cro_ctx.cro_header->offs_text = segment_start[SEG_TEXT];
    cro_ctx.cro_header->size_text = text_total_size;
    cro_ctx.cro_header->offs_data = segment_start[SEG_DATA];
    
+   tool_stats_count(STAT_SECTION_LOOKUPS);
    if (elf.sections[".bss"] != nullptr)
       cro_ctx.cro_header->size_bss = elf.sections[".bss"]->get_size();
 
@@ -472,17 +1223,20 @@ int main(int argc, char **argv)
       if (i == 4)
       {
          segment->offset = 0;
-         segment->size = 0/*cro_header_size*/;
+         segment->size = 0;
          segment->type = SEG_TEXT;
       }
    }
    
    cro_ctx.cro_header->size_file = cro_ctx.cro_size;
+   phase.next("hash");
+   cro_update_hash_table(cro_ctx.cro_data, cro_ctx.cro_size);
    
-   FILE* cro_file = fopen(argv[2], "wb");
+   phase.next("write file");
+   FILE* cro_file = fopen(output_path, "wb");
    if (!cro_file)
    {
-      printf("Failed to open file %s for writing! Exiting...\n", argv[2]);
+      printf("Failed to open file %s for writing! Exiting...\n", output_path);
       return -1;
    }
 
@@ -1,8 +1,17 @@
+#include <algorithm>
 #include <cstdlib>
+#include <fstream>
+#include <memory>
+#include <set>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
 #include "elfio/elfio.hpp"
 #include "elfio/elfio_dump.hpp"
+#include "sha256.h"
+#include "tool_stats.h"
+#include "alloc_trace.h"
 
 #include <map>
 
@@ -19,6 +28,7 @@ typedef struct
 
 bool ELF_get_symbol(symbol_section_accessor& syma, int index, ELF_Symbol& symbol_out)
 {
+   tool_stats_count(STAT_SYMBOLS);
    return syma.get_symbol(index, symbol_out.name, symbol_out.addr, symbol_out.size, symbol_out.bind, symbol_out.type, symbol_out.section_index, symbol_out.other);
 }
 
@@ -28,18 +38,40 @@ bool ELF_get_symbol_by_name(symbol_section_accessor& syma, std::string name, ELF
    return syma.get_symbol(name, symbol_out.addr, symbol_out.size, symbol_out.bind, symbol_out.type, symbol_out.section_index, symbol_out.other);
 }
 
-int ELF_get_symbol_index_by_name(symbol_section_accessor& syma, std::string name)
+// Symbol indexes by name, built once so merging and relocating payloads
+// doesn't rescan .dynsym for every name
+typedef std::unordered_map<std::string, int> Symbol_Index;
+
+Symbol_Index index_symbols(symbol_section_accessor& syma)
 {
+   Symbol_Index index;
+   index.reserve(syma.get_symbols_num());
    for (int i = 0; i < syma.get_symbols_num(); i++)
    {
       ELF_Symbol symbol;
       ELF_get_symbol(syma, i, symbol);
       
-      if (symbol.name == name)
-         return i;
+      // The first of several symbols with the same name is the one found
+      index.insert(std::make_pair(symbol.name, i));
    }
    
-   return -1;
+   return index;
+}
+
+int find_symbol(const Symbol_Index& index, const std::string& name)
+{
+   auto it = index.find(name);
+   return it == index.end() ? -1 : it->second;
+}
+
+// Everything but the name of a .dynsym entry for a payload symbol
+void set_payload_symbol(Elf32_Sym& entry, const endianess_convertor& convertor, Elf32_Addr value, const ELF_Symbol& symbol)
+{
+   entry.st_value = convertor(value);
+   entry.st_size = convertor((Elf_Word)symbol.size);
+   entry.st_info = ELF_ST_INFO(symbol.bind, symbol.type);
+   entry.st_other = symbol.other;
+   entry.st_shndx = convertor(symbol.section_index);
 }
 
 size_t align_up(size_t val, size_t align)
@@ -47,8 +79,45 @@ size_t align_up(size_t val, size_t align)
    return (val + (align - val % align) % align);
 }
 
+// Where a segment sat before injection, enough to rebase anything that
+// pointed into it
+typedef struct
+{
+   Elf64_Addr virtual_address;
+   Elf64_Addr physical_address;
+   Elf_Xword file_size;
+   Elf_Xword memory_size;
+} ELF_SegmentLayout;
+
+std::vector<ELF_SegmentLayout> get_segment_layout(elfio& elf)
+{
+   std::vector<ELF_SegmentLayout> layout(elf.segments.size());
+   for (int i = 0; i < elf.segments.size(); i++)
+   {
+      layout[i].virtual_address = elf.segments[i]->get_virtual_address();
+      layout[i].physical_address = elf.segments[i]->get_physical_address();
+      layout[i].file_size = elf.segments[i]->get_file_size();
+      layout[i].memory_size = elf.segments[i]->get_memory_size();
+   }
+   
+   return layout;
+}
+
+uint32_t addr_to_segment(const std::vector<ELF_SegmentLayout>& layout, Elf64_Addr addr)
+{
+   tool_stats_count(STAT_SEGMENT_LOOKUPS);
+   for (int i = 0; i < layout.size(); i++)
+   {
+      if (addr >= layout[i].virtual_address && addr < layout[i].virtual_address + layout[i].memory_size)
+         return i;
+   }
+   
+   return -1;
+}
+
 uint32_t addr_to_segment(elfio& elf, Elf64_Addr addr)
 {
+   tool_stats_count(STAT_SEGMENT_LOOKUPS);
    int seg_idx = -1;
    for (int i = 0; i < elf.segments.size(); i++)
    {
@@ -62,95 +131,781 @@ uint32_t addr_to_segment(elfio& elf, Elf64_Addr addr)
    return seg_idx;
 }
 
-int counts[3] = {0};
+// Original and injected relocations are buffered per target segment and
+// written out as a single .rela section each
+typedef std::vector<Elf32_Rela> Segment_Relocations;
+
 section* add_relocation_section(elfio& elf, int segment_index)
 {
    char* secs[3] = {".text", ".rodata", ".data"};
    char rela_name[32];
-   snprintf(rela_name, 32, ".rela%s.%u", secs[segment_index], counts[segment_index]++);
+   snprintf(rela_name, 32, ".rela%s", secs[segment_index]);
+   
+   // Reuse the section a previous cro2elf or elfinject run wrote
+   section* rel_sec = elf.sections[rela_name];
+   tool_stats_count(STAT_SECTION_LOOKUPS);
+   if (rel_sec != nullptr && rel_sec->get_type() == SHT_RELA)
+      return rel_sec;
    
    printf("Added %s\n", rela_name);
    
-   section* rel_sec = elf.sections.add(rela_name);
+   rel_sec = elf.sections.add(rela_name);
    rel_sec->set_type(SHT_RELA);
    rel_sec->set_entry_size(elf.get_default_entry_size(SHT_RELA));
    rel_sec->set_flags(SHF_ALLOC | SHF_INFO_LINK);
    rel_sec->set_info(elf.sections[segment_index+2]->get_index());
    rel_sec->set_overlay(elf.sections[segment_index+2]->get_index());
    rel_sec->set_link(elf.sections[".dynsym"]->get_index());
+   tool_stats_count(STAT_SECTION_LOOKUPS);
    rel_sec->set_addr_align(4);
    return rel_sec;
 }
 
+void add_relocation(Segment_Relocations* relocs, int segment_index, Elf32_Addr offset, Elf_Word symbol, unsigned char type, Elf32_Sword addend)
+{
+   Elf32_Rela entry;
+   entry.r_offset = offset;
+   entry.r_info = ELF32_R_INFO(symbol, type);
+   entry.r_addend = addend;
+   relocs[segment_index].push_back(entry);
+   tool_stats_count(STAT_RELOCS);
+}
+
+void write_relocation_sections(elfio& elf, Segment_Relocations* relocs)
+{
+   // Anything not rewritten below was consolidated into the per-segment sections
+   for (int k = 0; k < elf.sections.size(); k++)
+   {
+      tool_stats_count(STAT_SECTION_LOOKUPS);
+      if (elf.sections[k]->get_type() == SHT_RELA)
+         elf.sections[k]->set_data("", 0);
+   }
+   
+   const endianess_convertor& convertor = elf.get_convertor();
+   for (int i = 0; i < 3; i++)
+   {
+      if (relocs[i].empty()) continue;
+      
+      std::stable_sort(relocs[i].begin(), relocs[i].end(), [](const Elf32_Rela& a, const Elf32_Rela& b)
+      {
+         return a.r_offset < b.r_offset;
+      });
+      
+      for (auto& entry : relocs[i])
+      {
+         entry.r_offset = convertor(entry.r_offset);
+         entry.r_info = convertor(entry.r_info);
+         entry.r_addend = convertor(entry.r_addend);
+      }
+      
+      section* rel_sec = add_relocation_section(elf, i);
+      rel_sec->set_data((const char*)relocs[i].data(), relocs[i].size() * sizeof(Elf32_Rela));
+      tool_stats_count(STAT_ALLOCATIONS);
+      tool_stats_count(STAT_BYTES_COPIED, relocs[i].size() * sizeof(Elf32_Rela));
+   }
+}
+
+// What an injection did, written next to the output as <out.elf>.inject so
+// a later run where only some payloads changed can patch their part of the
+// output in place instead of rebuilding it from the input
+typedef struct
+{
+   std::string name;
+   bool defined;
+   bool override; // replaced a symbol of the same name, which went to <name>_orig
+   int index;     // .dynsym entry that got the payload's definition, -1 for none
+} Inject_Symbol;
+
+typedef struct
+{
+   std::string path;
+   std::string hash;
+   uint32_t offsets[5];  // where the payload went in each grown segment
+   uint32_t reserved[5]; // room it has there before the next payload
+   std::vector<Inject_Symbol> symbols; // every named payload symbol, in order
+   std::set<std::string> uses;         // output symbols its relocations were resolved against
+   bool contained;                     // all its relocations patch its own data
+} Inject_Payload;
+
+typedef struct
+{
+   std::string input_hash;
+   std::string output_hash;
+   std::vector<Inject_Payload> payloads;
+} Inject_Manifest;
+
+bool hash_file(const char* path, std::string& hash_out)
+{
+   FILE* file = fopen(path, "rb");
+   if (!file)
+      return false;
+   
+   SHA256_Context ctx;
+   sha256_init(ctx);
+   std::vector<uint8_t> buffer(0x100000);
+   size_t read;
+   while ((read = fread(buffer.data(), sizeof(uint8_t), buffer.size(), file)) > 0)
+      sha256_update(ctx, buffer.data(), read);
+   fclose(file);
+   
+   uint8_t hash[32];
+   sha256_final(ctx, hash);
+   char hex[65];
+   for (int i = 0; i < 32; i++)
+      snprintf(hex + i * 2, 3, "%02x", hash[i]);
+   hash_out = hex;
+   return true;
+}
+
+// Manifest lines are
+//    input <hash>
+//    output <hash>
+//    payload <hash> <path>
+//    place <segment> <offset, hex> <reserved, hex>
+//    symbol <.dynsym index or -1> <defined> <override> <name>
+//    uses <name>
+//    contained <0 or 1>
+// with the lines after a payload belonging to it
+bool write_manifest(const char* path, const Inject_Manifest& manifest)
+{
+   FILE* file = fopen(path, "w");
+   if (!file)
+      return false;
+   
+   fprintf(file, "# elfinject manifest\n");
+   fprintf(file, "input %s\n", manifest.input_hash.c_str());
+   fprintf(file, "output %s\n", manifest.output_hash.c_str());
+   for (const auto& payload : manifest.payloads)
+   {
+      fprintf(file, "payload %s %s\n", payload.hash.c_str(), payload.path.c_str());
+      for (int i = 0; i < 5; i++)
+         fprintf(file, "place %i %x %x\n", i, payload.offsets[i], payload.reserved[i]);
+      for (const auto& symbol : payload.symbols)
+         fprintf(file, "symbol %i %i %i %s\n", symbol.index, symbol.defined, symbol.override, symbol.name.c_str());
+      for (const auto& name : payload.uses)
+         fprintf(file, "uses %s\n", name.c_str());
+      fprintf(file, "contained %i\n", payload.contained);
+   }
+   
+   fclose(file);
+   return true;
+}
+
+bool load_manifest(const char* path, Inject_Manifest& manifest)
+{
+   std::ifstream file(path);
+   if (!file.is_open())
+      return false;
+   
+   std::string line;
+   while (std::getline(file, line))
+   {
+      if (line.empty() || line[0] == '#') continue;
+      
+      char kind[16], hash[65];
+      int segment, index, defined, override, contained, name_start;
+      uint32_t offset, reserved;
+      if (sscanf(line.c_str(), "%15s", kind) != 1)
+         return false;
+      
+      if (!strcmp(kind, "input") && sscanf(line.c_str(), "input %64s", hash) == 1)
+         manifest.input_hash = hash;
+      else if (!strcmp(kind, "output") && sscanf(line.c_str(), "output %64s", hash) == 1)
+         manifest.output_hash = hash;
+      else if (!strcmp(kind, "payload") && sscanf(line.c_str(), "payload %64s %n", hash, &name_start) == 1)
+      {
+         Inject_Payload payload = {line.substr(name_start), hash, {}, {}, {}, {}, false};
+         manifest.payloads.push_back(payload);
+      }
+      else if (manifest.payloads.empty())
+         return false;
+      else if (!strcmp(kind, "place") && sscanf(line.c_str(), "place %i %x %x", &segment, &offset, &reserved) == 3 && segment >= 0 && segment < 5)
+      {
+         manifest.payloads.back().offsets[segment] = offset;
+         manifest.payloads.back().reserved[segment] = reserved;
+      }
+      else if (!strcmp(kind, "symbol") && sscanf(line.c_str(), "symbol %i %i %i %n", &index, &defined, &override, &name_start) == 3)
+      {
+         Inject_Symbol symbol = {line.substr(name_start), defined != 0, override != 0, index};
+         manifest.payloads.back().symbols.push_back(symbol);
+      }
+      else if (!strcmp(kind, "uses"))
+         manifest.payloads.back().uses.insert(line.substr(5));
+      else if (!strcmp(kind, "contained") && sscanf(line.c_str(), "contained %i", &contained) == 1)
+         manifest.payloads.back().contained = contained != 0;
+      else
+         return false;
+   }
+   
+   return true;
+}
+
+// Where a payload symbol lands in the output. Overrides of existing symbols
+// are only moved by the payload's offset in its segment.
+uint32_t payload_symbol_addr(elfio& elf_inject, const ELF_Symbol& symbol, const uint32_t* inject_offsets, const uint32_t* new_offsets, bool override)
+{
+   if (!symbol.addr) return 0;
+   
+   int seg = addr_to_segment(elf_inject, symbol.addr);
+   if (override)
+      return symbol.addr + inject_offsets[seg];
+   return symbol.addr + inject_offsets[seg] - elf_inject.segments[seg]->get_virtual_address() + new_offsets[seg];
+}
+
+// Rebases one payload's relocations into the output, once its data is in place
+// and its symbols are merged
+void inject_payload_relocations(elfio& elf_out, elfio& elf_inject, symbol_section_accessor& syma, const Symbol_Index& symbol_index,
+                                const uint32_t* new_offsets, Segment_Relocations* relocs, Inject_Payload& record)
+{
+   const uint32_t* inject_offsets = record.offsets;
+   symbol_section_accessor syma_in(elf_inject, elf_inject.sections[".dynsym"]);
+   tool_stats_count(STAT_SECTION_LOOKUPS);
+   
+   // Add new relocations and adjust
+   record.uses.clear();
+   record.contained = true;
+   for (int k = 0; k < elf_inject.sections.size(); k++)
+   {
+      section* sec = elf_inject.sections[k];
+      tool_stats_count(STAT_SECTION_LOOKUPS);
+      if (sec->get_type() != SHT_RELA && sec->get_type() != SHT_REL) continue;
+   
+      //printf("%s %x\n", sec->get_name().c_str(), sec->get_info());
+   
+      int rel_seg_idx = -1;
+   
+      relocation_section_accessor rela(elf_inject, sec);
+      for (int i = 0; i < rela.get_entries_num(); i++)
+      {
+         Elf64_Addr offset;
+         Elf_Word symbol_idx;
+         Elf_Word type;
+         Elf_Sxword addend;
+
+         rela.get_entry(i, offset, symbol_idx, type, addend);
+         
+         ELF_Symbol symbol;
+         ELF_Symbol symbol_real;
+         ELF_get_symbol(syma_in, symbol_idx, symbol);
+         ELF_get_symbol(syma, find_symbol(symbol_index, symbol.name), symbol_real);
+      
+         rel_seg_idx = addr_to_segment(elf_inject, offset);
+         uint32_t new_addr = offset + (offset ? inject_offsets[rel_seg_idx] : 0);
+         uint32_t new_sym_addr = symbol.addr + (symbol.addr ? inject_offsets[rel_seg_idx] : 0);
+         uint32_t new_offset = new_sym_addr - new_offsets[rel_seg_idx];
+         //printf("%s %x %x->%x %i %x\n", symbol.name.c_str(), offset, offset, new_addr, rel_seg_idx, symbol_real.addr);
+      
+         if ((symbol_real.addr == 0) && (type == 0x2 || type == 0x16)) // Imports
+         {
+            offset = new_addr;
+            symbol_idx = find_symbol(symbol_index, symbol.name);
+         
+            uint32_t seg_offs = new_addr - new_offsets[rel_seg_idx];
+            uint32_t orig_value = *(uint32_t*)(elf_out.sections[rel_seg_idx+2]->get_data() + seg_offs);
+            *(uint32_t*)(elf_out.sections[rel_seg_idx+2]->get_data() + seg_offs) = 0;
+
+            type = 0x2;
+         }
+         else if (type == 0x2 || type == 0x16) // ABS32
+         {
+            offset = new_addr;
+            if (symbol.name == "") // Just some generic relocation
+            {
+               symbol_idx = rel_seg_idx+1;
+               addend += new_offset;
+            }
+            else // We're importing functions from the ELF being injected into, adjust
+            {
+               symbol_idx = addr_to_segment(elf_out, symbol_real.addr)+1;
+               addend += symbol_real.addr;
+               type = 0x2;
+               record.uses.insert(symbol.name);
+            
+               uint32_t seg_offs = new_addr - new_offsets[rel_seg_idx];
+               *(uint32_t*)(elf_out.sections[rel_seg_idx+2]->get_data() + seg_offs) = 0;
+            }
+         }
+         else if (type == 0x17) // Relative -> absolute
+         {
+            uint32_t seg_offs = new_addr - new_offsets[rel_seg_idx];
+            uint32_t orig_value = *(uint32_t*)(elf_out.sections[rel_seg_idx+2]->get_data() + seg_offs);
+            *(uint32_t*)(elf_out.sections[rel_seg_idx+2]->get_data() + seg_offs) = 0;
+         
+            //new_offsets[addr_to_segment(elf_inject, orig_value)] + inject_offsets[addr_to_segment(elf_inject, orig_value)]
+            uint32_t relative_target_seg = addr_to_segment(elf_inject, orig_value);
+            uint32_t relative_target = orig_value - elf_inject.segments[relative_target_seg]->get_virtual_address() + new_offsets[addr_to_segment(elf_inject, orig_value)] + inject_offsets[relative_target_seg];
+            //printf("relative %x %x %x\n", relative_target, seg_offs, addr_to_segment(elf_inject, orig_value));
+         
+            symbol_idx = relative_target_seg+1;
+            offset = new_addr;
+            addend = relative_target;
+            type = 0x2;
+         }
+
+         // Checked so a later run can tell this payload's relocations from the rest
+         if (rel_seg_idx < 0 || rel_seg_idx >= 5 || offset < new_offsets[rel_seg_idx] + inject_offsets[rel_seg_idx]
+             || offset >= new_offsets[rel_seg_idx] + inject_offsets[rel_seg_idx] + record.reserved[rel_seg_idx])
+            record.contained = false;
+         
+         add_relocation(relocs, rel_seg_idx, offset, symbol_idx, type, addend);
+      }
+   }
+}
+
+// Merges one payload's symbols into the output and rebases its relocations.
+// The record says where its data went in each grown segment and gets the
+// symbols it defined and used, for the manifest.
+void inject_payload(elfio& elf_out, elfio& elf_inject, symbol_section_accessor& syma, Symbol_Index& symbol_index,
+                    const uint32_t* new_offsets, Segment_Relocations* relocs, Inject_Payload& record)
+{
+   const uint32_t* inject_offsets = record.offsets;
+   symbol_section_accessor syma_in(elf_inject, elf_inject.sections[".dynsym"]);
+   section* dynsym_sec = elf_out.sections[".dynsym"];
+   section* dynstr_sec = elf_out.sections[".dynstr"];
+   tool_stats_count(STAT_SECTION_LOOKUPS, 3);
+   
+   // Each payload symbol is looked up by name and either skipped, overrides
+   // an existing symbol or is added. Overrides are written in place, added
+   // symbols and their names are appended to the tables in one go at the end.
+   Tool_Phase phase("merge symbols");
+   const endianess_convertor& convertor = elf_out.get_convertor();
+   Elf32_Sym* out_symbols = (Elf32_Sym*)dynsym_sec->get_data();
+   int num_existing = syma.get_symbols_num();
+   std::vector<Elf32_Sym> added;
+   std::string added_names;
+   Elf_Word strtab_size = dynstr_sec->get_size();
+   if (!strtab_size)
+      added_names.push_back('\0');
+   
+   // Symbols added earlier in this payload can be overridden too
+   auto entry_at = [&](int index) -> Elf32_Sym&
+   {
+      return index < num_existing ? out_symbols[index] : added[index - num_existing];
+   };
+   
+   auto add_entry = [&](const std::string& name, const Elf32_Sym& entry) -> int
+   {
+      int index = num_existing + added.size();
+      added.push_back(entry);
+      added.back().st_name = convertor((Elf_Word)(strtab_size + added_names.size()));
+      added_names.append(name.c_str(), name.size() + 1);
+      symbol_index.insert(std::make_pair(name, index));
+      return index;
+   };
+   
+   record.symbols.clear();
+   for (int i = 0; i < syma_in.get_symbols_num(); i++)
+   {
+      ELF_Symbol symbol;
+      ELF_get_symbol(syma_in, i, symbol);
+
+      if (symbol.name == "") continue;
+      
+      Inject_Symbol recorded = {symbol.name, symbol.addr != 0, false, -1};
+      record.symbols.push_back(recorded);
+      
+      // <name>_orig refers to the original of a symbol the payload overrides
+      const size_t suffix_len = strlen("_orig");
+      if (symbol.name.size() >= suffix_len && !symbol.name.compare(symbol.name.size() - suffix_len, suffix_len, "_orig")
+          && find_symbol(symbol_index, symbol.name.substr(0, symbol.name.size() - suffix_len)) != -1)
+         continue;
+
+      int orig_idx = find_symbol(symbol_index, symbol.name);
+      if (orig_idx != -1)
+      {
+         printf("identical name %s\n", symbol.name.c_str());
+         if (!symbol.addr) continue;
+         
+         // Rename things
+         printf("readjusting symbol names\n");
+         
+         // We have two symbols of the same name defined. The injected name takes precedence,
+         // and the original will be renamed to <name>_orig.
+         Elf32_Sym original = entry_at(orig_idx);
+         set_payload_symbol(entry_at(orig_idx), convertor, payload_symbol_addr(elf_inject, symbol, inject_offsets, new_offsets, true), symbol);
+         add_entry(symbol.name + "_orig", original);
+         record.symbols.back().override = true;
+         record.symbols.back().index = orig_idx;
+      }
+      else
+      {
+         printf("Adding %s %i\n", symbol.name.c_str(), addr_to_segment(elf_inject, symbol.addr));
+         
+         Elf32_Sym entry = {};
+         set_payload_symbol(entry, convertor, payload_symbol_addr(elf_inject, symbol, inject_offsets, new_offsets, false), symbol);
+         record.symbols.back().index = add_entry(symbol.name, entry);
+      }
+   }
+   
+   if (!added.empty())
+   {
+      dynstr_sec->append_data(added_names);
+      dynsym_sec->append_data((const char*)added.data(), added.size() * sizeof(Elf32_Sym));
+      tool_stats_count(STAT_ALLOCATIONS, 2);
+      tool_stats_count(STAT_BYTES_COPIED, added_names.size() + added.size() * sizeof(Elf32_Sym));
+   }
+   
+   phase.next("inject relocations");
+   inject_payload_relocations(elf_out, elf_inject, syma, symbol_index, new_offsets, relocs, record);
+}
+
+// Patches only the payloads that changed since the run that wrote the
+// manifest, as long as the input, the output and the other payloads are as
+// that run left them and each changed payload still fits the room it had.
+// Returns false when the output has to be rebuilt from the input instead, or
+// with failed set when writing the patched output didn't work.
+bool reinject_changed_payloads(int argc, char** argv, const std::string& manifest_path, bool& failed)
+{
+   failed = false;
+   Tool_Phase phase("check manifest");
+   Inject_Manifest manifest;
+   const char* output_path = argv[argc - 1];
+   if (!load_manifest(manifest_path.c_str(), manifest))
+      return false;
+   
+   std::string input_hash, output_hash;
+   if (manifest.payloads.size() != argc - 3 || !hash_file(argv[1], input_hash) || input_hash != manifest.input_hash
+       || !hash_file(output_path, output_hash) || output_hash != manifest.output_hash)
+   {
+      printf("%s doesn't match %s, rebuilding\n", output_path, manifest_path.c_str());
+      return false;
+   }
+   
+   std::vector<int> changed;
+   for (int p = 0; p < manifest.payloads.size(); p++)
+   {
+      std::string hash;
+      if (manifest.payloads[p].path != argv[p + 2] || !hash_file(argv[p + 2], hash))
+      {
+         printf("Payloads differ from %s, rebuilding\n", manifest_path.c_str());
+         return false;
+      }
+      
+      if (hash == manifest.payloads[p].hash) continue;
+      manifest.payloads[p].hash = hash;
+      changed.push_back(p);
+   }
+   
+   if (changed.empty())
+   {
+      printf("%s is up to date\n", output_path);
+      return true;
+   }
+   
+   phase.next("load elfs");
+   elfio elf_out;
+   elf_out.set_lazy_load(true);
+   if (!elf_out.load(output_path))
+      return false;
+   
+   std::vector<std::unique_ptr<elfio>> payloads(manifest.payloads.size());
+   for (int p : changed)
+   {
+      payloads[p].reset(new elfio());
+      payloads[p]->set_lazy_load(true);
+      if (!payloads[p]->load(argv[p + 2]))
+      {
+         printf("Failed to load file %s! Exiting...\n", argv[p + 2]);
+         return false;
+      }
+   }
+   
+   // The new payload has to fit where the old one was and define the same
+   // symbols, so nothing outside of its own part of the output moves
+   phase.next("check payloads");
+   uint32_t new_offsets[5] = {};
+   for (int i = 0; i < elf_out.segments.size() && i < 5; i++)
+      new_offsets[i] = elf_out.segments[i]->get_virtual_address();
+   
+   for (int p : changed)
+   {
+      Inject_Payload& record = manifest.payloads[p];
+      elfio& elf_inject = *payloads[p];
+      bool fits = record.contained;
+      for (int i = 0; i < elf_inject.segments.size(); i++)
+      {
+         Elf_Xword size = elf_inject.segments[i]->get_memory_size();
+         if (size && (i >= 5 || i >= elf_out.segments.size() || size > record.reserved[i]))
+            fits = false;
+         else if (i < 5 && elf_out.sections[i+2]->get_type() != SHT_NOBITS && record.offsets[i] + record.reserved[i] > elf_out.sections[i+2]->get_size())
+            fits = false;
+      }
+      
+      symbol_section_accessor syma_in(elf_inject, elf_inject.sections[".dynsym"]);
+      tool_stats_count(STAT_SECTION_LOOKUPS);
+      size_t named = 0;
+      for (int i = 0; i < syma_in.get_symbols_num() && fits; i++)
+      {
+         ELF_Symbol symbol;
+         ELF_get_symbol(syma_in, i, symbol);
+         if (symbol.name == "") continue;
+         
+         fits = named < record.symbols.size() && record.symbols[named].name == symbol.name && record.symbols[named].defined == (symbol.addr != 0);
+         named++;
+      }
+      
+      if (!fits || named != record.symbols.size())
+      {
+         printf("%s no longer fits in place, rebuilding\n", record.path.c_str());
+         return false;
+      }
+   }
+   
+   // Everything but the changed payloads' relocations stays as it is
+   phase.next("patch payloads");
+   Segment_Relocations relocs[3];
+   for (int k = 0; k < elf_out.sections.size(); k++)
+   {
+      section* sec = elf_out.sections[k];
+      tool_stats_count(STAT_SECTION_LOOKUPS);
+      if (sec->get_type() != SHT_RELA) continue;
+      
+      relocation_section_accessor rela(elf_out, sec);
+      for (int i = 0; i < rela.get_entries_num(); i++)
+      {
+         Elf64_Addr offset;
+         Elf_Word symbol_idx;
+         Elf_Word type;
+         Elf_Sxword addend;
+         
+         rela.get_entry(i, offset, symbol_idx, type, addend);
+         int seg = addr_to_segment(elf_out, offset);
+         if (seg < 0 || seg >= 3)
+            return false;
+         
+         bool replaced = false;
+         for (int p : changed)
+         {
+            const Inject_Payload& record = manifest.payloads[p];
+            if (offset >= new_offsets[seg] + record.offsets[seg] && offset < new_offsets[seg] + record.offsets[seg] + record.reserved[seg])
+               replaced = true;
+         }
+         
+         if (!replaced)
+            add_relocation(relocs, seg, offset, symbol_idx, type, addend);
+      }
+   }
+   
+   symbol_section_accessor syma(elf_out, elf_out.sections[".dynsym"]);
+   tool_stats_count(STAT_SECTION_LOOKUPS);
+   Symbol_Index symbol_index = index_symbols(syma);
+   const endianess_convertor& convertor = elf_out.get_convertor();
+   for (int p : changed)
+   {
+      Inject_Payload& record = manifest.payloads[p];
+      elfio& elf_inject = *payloads[p];
+      
+      // New data over the old, with the rest of the room cleared
+      for (int i = 0; i < elf_out.segments.size() && i < 5; i++)
+      {
+         section* sec = elf_out.sections[i+2];
+         if (!record.reserved[i] || sec->get_type() == SHT_NOBITS) continue;
+         
+         char* data = (char*)sec->get_data();
+         memset(data + record.offsets[i], 0, record.reserved[i]);
+         if (i < elf_inject.segments.size() && elf_inject.segments[i]->get_file_size())
+            memcpy(data + record.offsets[i], elf_inject.segments[i]->get_data(), elf_inject.segments[i]->get_file_size());
+         tool_stats_count(STAT_BYTES_COPIED, record.reserved[i]);
+      }
+      
+      // Same symbols as before, only their values and sizes change
+      symbol_section_accessor syma_in(elf_inject, elf_inject.sections[".dynsym"]);
+      tool_stats_count(STAT_SECTION_LOOKUPS);
+      Elf32_Sym* out_symbols = (Elf32_Sym*)elf_out.sections[".dynsym"]->get_data();
+      tool_stats_count(STAT_SECTION_LOOKUPS);
+      size_t named = 0;
+      for (int i = 0; i < syma_in.get_symbols_num(); i++)
+      {
+         ELF_Symbol symbol;
+         ELF_get_symbol(syma_in, i, symbol);
+         if (symbol.name == "") continue;
+         
+         const Inject_Symbol& recorded = record.symbols[named++];
+         if (recorded.index == -1) continue;
+         
+         uint32_t new_addr = payload_symbol_addr(elf_inject, symbol, record.offsets, new_offsets, recorded.override);
+         set_payload_symbol(out_symbols[recorded.index], convertor, new_addr, symbol);
+      }
+      
+      inject_payload_relocations(elf_out, elf_inject, syma, symbol_index, new_offsets, relocs, record);
+      if (!record.contained)
+      {
+         printf("%s no longer fits in place, rebuilding\n", record.path.c_str());
+         return false;
+      }
+   }
+   
+   // A later payload could have been resolved against a changed one's
+   // symbols, or the other way around, with values that no longer hold
+   for (int p : changed)
+   {
+      for (int q = p + 1; q < manifest.payloads.size(); q++)
+      {
+         bool q_changed = std::find(changed.begin(), changed.end(), q) != changed.end();
+         for (const auto& symbol : manifest.payloads[q].symbols)
+         {
+            if (symbol.index != -1 && manifest.payloads[p].uses.count(symbol.name))
+               return false;
+         }
+         
+         for (const auto& symbol : manifest.payloads[p].symbols)
+         {
+            if (!q_changed && symbol.index != -1 && manifest.payloads[q].uses.count(symbol.name))
+               return false;
+         }
+      }
+   }
+   
+   phase.next("write relocations");
+   write_relocation_sections(elf_out, relocs);
+   
+   phase.next("save");
+   if (!elf_out.save(output_path) || !hash_file(output_path, manifest.output_hash) || !write_manifest(manifest_path.c_str(), manifest))
+   {
+      printf("Failed to update %s! Exiting...\n", output_path);
+      failed = true;
+      return false;
+   }
+   
+   printf("Patched %zu changed payload(s) into %s\n", changed.size(), output_path);
+   return true;
+}
+
 int main(int argc, char **argv)
 {
-   if (argc < 3)
+   Tool_Stats_Report stats_report("elfinject", tool_stats_parse_args(argc, argv));
+   if (argc < 4)
    {
-      printf("Usage: %s <input.elf> <inject.elf> <out.elf>\n", argv[0]);
+      printf("Usage: %s [--stats[=<file.json>]] <input.elf> <inject.elf> [<inject.elf>...] <out.elf>\n", argv[0]);
       return -1;
    }
+   
+   // A manifest from an earlier run lets the payloads that changed since be
+   // patched into its output in place
+   std::string manifest_path = std::string(argv[argc - 1]) + ".inject";
+   bool reinject_failed;
+   if (reinject_changed_payloads(argc, argv, manifest_path, reinject_failed))
+      return 0;
+   if (reinject_failed)
+      return -1;
 
-   elfio elf_input;
-   elfio elf_inject;
+   Tool_Phase phase("load elfs");
    elfio elf_out;
    
-   if (!elf_input.load(argv[1]) | !elf_out.load(argv[1]))
+   // Only the output has to be read in full, and save() takes care of that
+   elf_out.set_lazy_load(true);
+   
+   if (!elf_out.load(argv[1]))
    {
       printf("Failed to load file %s! Exiting...\n", argv[1]);
       return -1;
    }
    
-   if (!elf_inject.load(argv[2]))
+   // The input is rewritten in place, only its original layout is kept aside
+   std::vector<ELF_SegmentLayout> input_layout = get_segment_layout(elf_out);
+   
+   // Hashed before the output can overwrite it
+   Inject_Manifest manifest;
+   bool hashed = hash_file(argv[1], manifest.input_hash);
+   
+   // Payloads are applied in the order given, as if elfinject ran once per
+   // payload, but the original module is only grown and rebased once
+   std::vector<std::unique_ptr<elfio>> payloads;
+   for (int p = 2; p < argc - 1; p++)
    {
-      printf("Failed to load file %s! Exiting...\n", argv[1]);
-      return -1;
+      payloads.emplace_back(new elfio());
+      payloads.back()->set_lazy_load(true);
+      if (!payloads.back()->load(argv[p]))
+      {
+         printf("Failed to load file %s! Exiting...\n", argv[p]);
+         return -1;
+      }
    }
 
+   phase.next("grow segments");
+   size_t num_segments = 0;
+   for (auto& payload : payloads)
+      num_segments = std::max(num_segments, (size_t)payload->segments.size());
+   num_segments = std::min(num_segments, std::min((size_t)elf_out.segments.size(), (size_t)5));
+   
+   // Lowest address the next segment can start at without overlapping the
+   // grown ones before it. Payload code is linked at 0x180, same as .text.
    uint32_t next_addr = 0x180;
-   uint32_t inject_offsets[5];
+   manifest.payloads.resize(payloads.size());
    uint32_t new_offsets[5];
    size_t added_size = 0;
-   for (int i = 0; i < elf_inject.segments.size(); i++)
+   for (int i = 0; i < num_segments; i++)
    {
-      if (i >= elf_out.segments.size()) break;
-
-      inject_offsets[i] = align_up(elf_out.segments[i]->get_memory_size(), 0x4);
+      uint32_t orig_size = align_up(elf_out.segments[i]->get_memory_size(), 0x4);
       
       if (i == 3)
-         inject_offsets[i] = align_up(elf_out.sections[i+2]->get_size(), 0x4);
+         orig_size = align_up(elf_out.sections[i+2]->get_size(), 0x4);
+      
+      // Each payload's part of the segment goes after the original data and
+      // the payloads before it
+      uint32_t new_size = orig_size;
+      uint32_t file_end = orig_size;
+      for (int p = 0; p < payloads.size(); p++)
+      {
+         manifest.payloads[p].offsets[i] = align_up(new_size, 0x4);
+         if (i >= payloads[p]->segments.size()) continue;
+         
+         new_size = manifest.payloads[p].offsets[i] + payloads[p]->segments[i]->get_memory_size();
+         file_end = std::max(file_end, (uint32_t)(manifest.payloads[p].offsets[i] + payloads[p]->segments[i]->get_file_size()));
+      }
       
-      char *new_data = (char*)calloc(inject_offsets[i] + elf_inject.segments[i]->get_memory_size(), 1);
+      for (int p = 0; p < payloads.size(); p++)
+      {
+         uint32_t room_end = p + 1 < payloads.size() ? manifest.payloads[p + 1].offsets[i] : new_size;
+         manifest.payloads[p].reserved[i] = room_end > manifest.payloads[p].offsets[i] ? room_end - manifest.payloads[p].offsets[i] : 0;
+      }
+      
+      char *new_data = (char*)calloc(new_size, 1);
+      tool_stats_count(STAT_ALLOCATIONS);
 
       // Copy existing data
-      if (elf_input.segments[i]->get_file_size())
-         memcpy(new_data, elf_input.segments[i]->get_data(), elf_input.segments[i]->get_file_size());
+      if (input_layout[i].file_size)
+         memcpy(new_data, elf_out.segments[i]->get_data(), input_layout[i].file_size);
+      tool_stats_count(STAT_BYTES_COPIED, input_layout[i].file_size);
       
       // Concatenate new data
-      if (elf_inject.segments[i]->get_file_size())
-         memcpy(new_data + inject_offsets[i], elf_inject.segments[i]->get_data(), elf_inject.segments[i]->get_file_size());
+      for (int p = 0; p < payloads.size(); p++)
+      {
+         if (i >= payloads[p]->segments.size() || !payloads[p]->segments[i]->get_file_size()) continue;
+         
+         memcpy(new_data + manifest.payloads[p].offsets[i], payloads[p]->segments[i]->get_data(), payloads[p]->segments[i]->get_file_size());
+         tool_stats_count(STAT_BYTES_COPIED, payloads[p]->segments[i]->get_file_size());
+      }
       
       // Sections should be in order with .text at 2, then .rodata, .data, .bss, .cro_info
-      elf_out.sections[i+2]->set_data(new_data, inject_offsets[i] + elf_inject.segments[i]->get_memory_size());
+      elf_out.sections[i+2]->set_data(new_data, new_size);
+      tool_stats_count(STAT_ALLOCATIONS);
+      tool_stats_count(STAT_BYTES_COPIED, new_size);
       elf_out.segments[i]->add_section_index(elf_out.sections[i+2]->get_index(), elf_out.sections[i+2]->get_addr_align());
       
-      // Adjust addresses, .data will not be accurate but it doesn't matter really since that will correct with
-      // elf2cro anyhow.
-      added_size += (inject_offsets[i] + elf_inject.segments[i]->get_memory_size() - elf_input.segments[i]->get_memory_size());
-      new_offsets[i] = next_addr;
-      elf_out.sections[i+2]->set_address(next_addr);
-      elf_out.segments[i]->set_physical_address(next_addr);
-      elf_out.segments[i]->set_virtual_address(next_addr);
-      elf_out.segments[i]->set_file_size(elf_out.segments[i]->get_file_size() + elf_inject.segments[i]->get_memory_size());
-      elf_out.segments[i]->set_memory_size(elf_out.segments[i]->get_memory_size() + elf_inject.segments[i]->get_memory_size());
+      // Segments keep their address while the growth before them fits in the
+      // gap to the previous one, which is mostly the page padding elf2cro
+      // left. Only those pushed past it move, and only as far as they must,
+      // so most of the original symbols and relocations keep their values.
+      // .data will not be accurate but it doesn't matter really since that
+      // will correct with elf2cro anyhow.
+      added_size += (new_size - input_layout[i].memory_size);
+      new_offsets[i] = std::max((uint32_t)input_layout[i].virtual_address, next_addr);
+      elf_out.sections[i+2]->set_address(new_offsets[i]);
+      elf_out.segments[i]->set_physical_address(new_offsets[i]);
+      elf_out.segments[i]->set_virtual_address(new_offsets[i]);
+      if (elf_out.sections[i+2]->get_type() != SHT_NOBITS)
+         elf_out.segments[i]->set_file_size(elf_out.segments[i]->get_file_size() + new_size - orig_size);
+      elf_out.segments[i]->set_memory_size(elf_out.segments[i]->get_memory_size() + new_size - orig_size);
       
-      next_addr = align_up(next_addr + inject_offsets[i] + elf_inject.segments[i]->get_file_size(), 0x4);
+      next_addr = align_up(new_offsets[i] + file_end, 0x4);
    }
    
    symbol_section_accessor syma(elf_out, elf_out.sections[".dynsym"]);
-   string_section_accessor stra(elf_out.sections[".dynstr"]);
-   symbol_section_accessor syma_in(elf_inject, elf_inject.sections[".dynsym"]);
+   tool_stats_count(STAT_SECTION_LOOKUPS);
    
    // Adjust original symbols
+   phase.next("rebase symbols");
    for (int i = 1; i < syma.get_symbols_num(); i++)
    {
       ELF_Symbol symbol;
@@ -160,16 +915,20 @@ int main(int argc, char **argv)
       if (!symbol.addr) continue;
       
       
-      uint32_t new_addr = symbol.addr - elf_input.segments[addr_to_segment(elf_input, symbol.addr)]->get_physical_address() + new_offsets[addr_to_segment(elf_input, symbol.addr)];
+      uint32_t new_addr = symbol.addr - input_layout[addr_to_segment(input_layout, symbol.addr)].physical_address + new_offsets[addr_to_segment(input_layout, symbol.addr)];
       
       //printf("%s old %x new %x\n", symbol.name.c_str(), symbol.addr, new_addr);
       ((Elf32_Sym*)elf_out.sections[".dynsym"]->get_data())[i].st_value = new_addr;
+      tool_stats_count(STAT_SECTION_LOOKUPS);
    }
    
    // Adjust original relocations
+   phase.next("rebase relocations");
+   Segment_Relocations relocs[3];
    for (int k = 0; k < elf_out.sections.size(); k++)
    {
       section* sec = elf_out.sections[k];
+      tool_stats_count(STAT_SECTION_LOOKUPS);
       if (sec->get_type() != SHT_RELA) continue;
 
       relocation_section_accessor rela_orig(elf_out, sec);
@@ -185,210 +944,72 @@ int main(int argc, char **argv)
          ELF_Symbol symbol;
          ELF_get_symbol(syma, symbol_idx, symbol);
          
-         uint32_t new_offset = offset - elf_input.segments[addr_to_segment(elf_input, offset)]->get_physical_address() + new_offsets[addr_to_segment(elf_input, offset)];
+         uint32_t new_offset = offset - input_layout[addr_to_segment(input_layout, offset)].physical_address + new_offsets[addr_to_segment(input_layout, offset)];
          uint32_t new_addend = addend;
          if (type == 0x2 || type == 0x16)
          {
-            if (addr_to_segment(elf_input, addend) != -1)
+            if (addr_to_segment(input_layout, addend) != -1)
             {
-               new_addend = addend - elf_input.segments[addr_to_segment(elf_input, addend)]->get_physical_address() + new_offsets[addr_to_segment(elf_input, addend)];
+               new_addend = addend - input_layout[addr_to_segment(input_layout, addend)].physical_address + new_offsets[addr_to_segment(input_layout, addend)];
                //printf("Addend %x to %x\n", addend, new_addend);
             }
          }
          else if (type == 0x17) // Relative -> absolute
          {
-            int rel_seg_idx = addr_to_segment(elf_input, offset);
+            int rel_seg_idx = addr_to_segment(input_layout, offset);
             uint32_t seg_offs = new_offset - new_offsets[rel_seg_idx];
             uint32_t orig_value = *(uint32_t*)(elf_out.sections[rel_seg_idx+2]->get_data() + seg_offs);
             *(uint32_t*)(elf_out.sections[rel_seg_idx+2]->get_data() + seg_offs) = 0;
             
-            int32_t relative_target_seg = addr_to_segment(elf_input, orig_value);
+            int32_t relative_target_seg = addr_to_segment(input_layout, orig_value);
             
-            if (relative_target_seg == -1 && orig_value == elf_input.segments[0]->get_virtual_address() + elf_input.segments[0]->get_file_size())
+            if (relative_target_seg == -1 && orig_value == input_layout[0].virtual_address + input_layout[0].file_size)
             {
                relative_target_seg = 0;
             }
             
             //printf("%x %x %x\n", new_offset, relative_target_seg, orig_value);
-            uint32_t relative_target = orig_value - elf_input.segments[relative_target_seg]->get_virtual_address() + new_offsets[relative_target_seg];
+            uint32_t relative_target = orig_value - input_layout[relative_target_seg].virtual_address + new_offsets[relative_target_seg];
             //printf("relative %x %x %x\n", relative_target, seg_offs, relative_target_seg);
             
-            ((Elf32_Rela*)sec->get_data())[i].r_info = ELF32_R_INFO(relative_target_seg+1, 2);
+            symbol_idx = relative_target_seg+1;
+            type = 2;
             new_addend = relative_target;
          }
-         ((Elf32_Rela*)sec->get_data())[i].r_offset = new_offset;
-         ((Elf32_Rela*)sec->get_data())[i].r_addend = new_addend;
+         add_relocation(relocs, addr_to_segment(input_layout, offset), new_offset, symbol_idx, type, new_addend);
          
          /*if (offset != new_offset)
             printf("old %x new %x\n", offset, new_offset);*/
       }
    }
    
-   // Add in new symbols, and adjust for new offsets
-   for (int i = 0; i < syma_in.get_symbols_num(); i++)
-   {
-      ELF_Symbol symbol;
-      ELF_get_symbol(syma_in, i, symbol);
-
-      if (symbol.name == "") continue;
-      
-      if (!strcmp(symbol.name.c_str() + strlen(symbol.name.c_str()) - strlen("_orig"), "_orig"))
-      {
-         char *not_orig = (char*)calloc(strlen(symbol.name.c_str()) - strlen("_orig") + 1, 1);
-         memcpy(not_orig, symbol.name.c_str(), strlen(symbol.name.c_str()) - strlen("_orig"));
-         if (ELF_get_symbol_index_by_name(syma, std::string(not_orig)) != -1)
-         {
-            //printf("Ignore\n");
-            continue;
-         }
-         
-      }
-      
-
-      if (ELF_get_symbol_index_by_name(syma, symbol.name) != -1)
-      {
-         int orig_idx = ELF_get_symbol_index_by_name(syma, symbol.name);
-         ELF_Symbol symbol_orig;
-         ELF_Symbol symbol_new;
-         ELF_get_symbol(syma, orig_idx, symbol_orig);
-         
-         printf("identical name %s\n", symbol.name.c_str());
-         if (symbol.addr)
-         {
-            // Rename things
-            printf("readjusting symbol names\n");
-            
-            // We have two symbols of the same name defined. The injected name takes precedence,
-            // and the original will be renamed to <name>_orig.
-            std::string renamed = symbol.name + "_orig";
-            uint32_t new_addr = symbol.addr + (symbol.addr ? inject_offsets[addr_to_segment(elf_inject, symbol.addr)] : 0);
-            int index = syma.add_symbol(stra, renamed.c_str(), new_addr, symbol.size, symbol.bind, symbol.type, symbol.other, symbol.section_index);
-            ELF_get_symbol(syma, index, symbol_new);
-
-            section *sec = elf_out.sections[".dynsym"];
-            
-            Elf32_Addr temp_value = ((Elf32_Sym*)sec->get_data())[index].st_value;
-            Elf_Word temp_size = ((Elf32_Sym*)sec->get_data())[index].st_size;
-            unsigned char temp_info = ((Elf32_Sym*)sec->get_data())[index].st_info;
-            unsigned char temp_other = ((Elf32_Sym*)sec->get_data())[index].st_other;
-            Elf_Half temp_shndx = ((Elf32_Sym*)sec->get_data())[index].st_shndx;
-            
-            ((Elf32_Sym*)sec->get_data())[index].st_value = ((Elf32_Sym*)sec->get_data())[orig_idx].st_value;
-            ((Elf32_Sym*)sec->get_data())[index].st_size = ((Elf32_Sym*)sec->get_data())[orig_idx].st_size;
-            ((Elf32_Sym*)sec->get_data())[index].st_info = ((Elf32_Sym*)sec->get_data())[orig_idx].st_info;
-            ((Elf32_Sym*)sec->get_data())[index].st_other = ((Elf32_Sym*)sec->get_data())[orig_idx].st_other;
-            ((Elf32_Sym*)sec->get_data())[index].st_shndx = ((Elf32_Sym*)sec->get_data())[orig_idx].st_shndx;
-            
-            ((Elf32_Sym*)sec->get_data())[orig_idx].st_value = temp_value;
-            ((Elf32_Sym*)sec->get_data())[orig_idx].st_size = temp_size;
-            ((Elf32_Sym*)sec->get_data())[orig_idx].st_info = temp_info;
-            ((Elf32_Sym*)sec->get_data())[orig_idx].st_other = temp_other;
-            ((Elf32_Sym*)sec->get_data())[orig_idx].st_shndx = temp_shndx;
-         }
-      }
-      else
-      {
-         printf("Adding %s %i\n", symbol.name.c_str(), addr_to_segment(elf_inject, symbol.addr));
-         
-         uint32_t new_addr = 0;
-         if (symbol.addr)
-            new_addr = symbol.addr + inject_offsets[addr_to_segment(elf_inject, symbol.addr)] - elf_inject.segments[addr_to_segment(elf_inject, symbol.addr)]->get_virtual_address() + new_offsets[addr_to_segment(elf_inject, symbol.addr)];
+   phase.next("index symbols");
+   Symbol_Index symbol_index = index_symbols(syma);
+   
+   // Later payloads see the symbols earlier ones added, and override them
+   // the same way they override the original module's
+   phase.next("inject payloads");
+   for (int p = 0; p < payloads.size(); p++)
+      inject_payload(elf_out, *payloads[p], syma, symbol_index, new_offsets, relocs, manifest.payloads[p]);
+   
+   phase.next("write relocations");
+   write_relocation_sections(elf_out, relocs);
 
-         int index = syma.add_symbol(stra, symbol.name.c_str(), new_addr, symbol.size, symbol.bind, symbol.type, symbol.other, symbol.section_index);
-      }
+   phase.next("save");
+   if (!elf_out.save(argv[argc - 1]))
+   {
+      printf("Failed to open file %s for writing! Exiting...\n", argv[argc - 1]);
+      return -1;
    }
    
-   // Add new relocations and adjust
-   int last_rela = -1;
-   relocation_section_accessor* rel_accessor = nullptr;
-   for (int k = 0; k < elf_inject.sections.size(); k++)
+   phase.next("write manifest");
+   hashed = hashed && hash_file(argv[argc - 1], manifest.output_hash);
+   for (int p = 0; p < payloads.size(); p++)
    {
-      section* sec = elf_inject.sections[k];
-      if (sec->get_type() != SHT_RELA && sec->get_type() != SHT_REL) continue;
-      
-      //printf("%s %x\n", sec->get_name().c_str(), sec->get_info());
-      
-      int rel_seg_idx = -1;
-      int last_rela = -1;
-      
-      relocation_section_accessor rela(elf_inject, sec);
-      for (int i = 0; i < rela.get_entries_num(); i++)
-      {
-         Elf64_Addr offset;
-         Elf_Word symbol_idx;
-         Elf_Word type;
-         Elf_Sxword addend;
-
-         rela.get_entry(i, offset, symbol_idx, type, addend);
-            
-         ELF_Symbol symbol;
-         ELF_Symbol symbol_real;
-         ELF_get_symbol(syma_in, symbol_idx, symbol);
-         ELF_get_symbol(syma, ELF_get_symbol_index_by_name(syma, symbol.name), symbol_real);
-         
-         rel_seg_idx = addr_to_segment(elf_inject, offset);
-         uint32_t new_addr = offset + (offset ? inject_offsets[rel_seg_idx] : 0);
-         uint32_t new_sym_addr = symbol.addr + (symbol.addr ? inject_offsets[rel_seg_idx] : 0);
-         uint32_t new_offset = new_sym_addr - new_offsets[rel_seg_idx];
-         //printf("%s %x %x->%x %i %x\n", symbol.name.c_str(), offset, offset, new_addr, rel_seg_idx, symbol_real.addr);
-         
-         if (last_rela != rel_seg_idx)
-         {
-            if (rel_accessor != nullptr)
-               delete rel_accessor;
-            rel_accessor = new relocation_section_accessor(elf_out, add_relocation_section(elf_out, rel_seg_idx));
-         }
-         
-         if ((symbol_real.addr == 0) && (type == 0x2 || type == 0x16)) // Imports
-         {
-            offset = new_addr;
-            symbol_idx = ELF_get_symbol_index_by_name(syma, symbol.name);
-            
-            uint32_t seg_offs = new_addr - new_offsets[rel_seg_idx];
-            uint32_t orig_value = *(uint32_t*)(elf_out.sections[rel_seg_idx+2]->get_data() + seg_offs);
-            *(uint32_t*)(elf_out.sections[rel_seg_idx+2]->get_data() + seg_offs) = 0;
-
-            type = 0x2;
-         }
-         else if (type == 0x2 || type == 0x16) // ABS32
-         {
-            offset = new_addr;
-            if (symbol.name == "") // Just some generic relocation
-            {
-               symbol_idx = rel_seg_idx+1;
-               addend += new_offset;
-            }
-            else // We're importing functions from the ELF being injected into, adjust
-            {
-               symbol_idx = addr_to_segment(elf_out, symbol_real.addr)+1;
-               addend += symbol_real.addr;
-               type = 0x2;
-               
-               uint32_t seg_offs = new_addr - new_offsets[rel_seg_idx];
-               *(uint32_t*)(elf_out.sections[rel_seg_idx+2]->get_data() + seg_offs) = 0;
-            }
-         }
-         else if (type == 0x17) // Relative -> absolute
-         {
-            uint32_t seg_offs = new_addr - new_offsets[rel_seg_idx];
-            uint32_t orig_value = *(uint32_t*)(elf_out.sections[rel_seg_idx+2]->get_data() + seg_offs);
-            *(uint32_t*)(elf_out.sections[rel_seg_idx+2]->get_data() + seg_offs) = 0;
-            
-            //new_offsets[addr_to_segment(elf_inject, orig_value)] + inject_offsets[addr_to_segment(elf_inject, orig_value)]
-            uint32_t relative_target_seg = addr_to_segment(elf_inject, orig_value);
-            uint32_t relative_target = orig_value - elf_inject.segments[relative_target_seg]->get_virtual_address() + new_offsets[addr_to_segment(elf_inject, orig_value)] + inject_offsets[relative_target_seg];
-            //printf("relative %x %x %x\n", relative_target, seg_offs, addr_to_segment(elf_inject, orig_value));
-            
-            symbol_idx = relative_target_seg+1;
-            offset = new_addr;
-            addend = relative_target;
-            type = 0x2;
-         }
-
-         rel_accessor->add_entry(offset, symbol_idx, type, addend);
-         last_rela = rel_seg_idx;
-      }
+      manifest.payloads[p].path = argv[p + 2];
+      hashed = hashed && hash_file(argv[p + 2], manifest.payloads[p].hash);
    }
-
-   elf_out.save(argv[3]);
+   
+   if (!hashed || !write_manifest(manifest_path.c_str(), manifest))
+      printf("Failed to write %s, the next run will rebuild everything\n", manifest_path.c_str());
 }
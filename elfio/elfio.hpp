@@ -76,6 +76,7 @@ class elfio
     {
         header           = 0;
         current_file_pos = 0;
+        lazy_load        = false;
         create( ELFCLASS32, ELFDATA2LSB );
     }
 
@@ -94,9 +95,37 @@ class elfio
         create_mandatory_sections();
     }
 
+//------------------------------------------------------------------------------
+    // With lazy loading, load() only reads the headers and the section name
+    // table. Section and segment data is read from the file on the first
+    // get_data(), except for sections of a type added with
+    // add_preload_type(). A stream passed to load() must then outlive
+    // the sections; a file opened by name stays open until the next load.
+    void set_lazy_load( bool lazy )
+    {
+        lazy_load = lazy;
+    }
+
+//------------------------------------------------------------------------------
+    void add_preload_type( Elf_Word section_type )
+    {
+        preload_types.push_back( section_type );
+    }
+
 //------------------------------------------------------------------------------
     bool load( const std::string& file_name )
     {
+        if ( lazy_load ) {
+            lazy_file.close();
+            lazy_file.clear();
+            lazy_file.open( file_name.c_str(), std::ios::in | std::ios::binary );
+            if ( !lazy_file ) {
+                return false;
+            }
+
+            return load( lazy_file );
+        }
+
         std::ifstream stream;
         stream.open( file_name.c_str(), std::ios::in | std::ios::binary );
         if ( !stream ) {
@@ -150,6 +179,12 @@ class elfio
 //------------------------------------------------------------------------------
     bool save( const std::string& file_name )
     {
+        // Sections still in the input file are read before it can be
+        // overwritten, file_name may well be the file they came from
+        for ( unsigned int i = 0; i < sections_.size(); ++i ) {
+            sections_[i]->get_data();
+        }
+
         std::ofstream f( file_name.c_str(), std::ios::out | std::ios::binary );
 
         if ( !f ) {
@@ -358,8 +393,14 @@ class elfio
 
         for ( Elf_Half i = 0; i < num; ++i ) {
             section* sec = create_section();
-            sec->load( stream, (std::streamoff)offset + i * entry_size );
+            sec->load( stream, (std::streamoff)offset + i * entry_size,
+                       lazy_load );
             sec->set_index( i );
+            if ( lazy_load &&
+                 std::find( preload_types.begin(), preload_types.end(),
+                            sec->get_type() ) != preload_types.end() ) {
+                sec->get_data();
+            }
             // To mark that the section is not permitted to reassign address
             // during layout calculation
             sec->set_address( sec->get_address() );
@@ -402,7 +443,7 @@ class elfio
                 return false;
             }
 
-            seg->load( stream, (std::streamoff)offset + i * entry_size );
+            seg->load( stream, (std::streamoff)offset + i * entry_size, true );
             seg->set_index( i );
 
             // Add sections to the segments (similar to readelfs algorithm)
@@ -425,6 +466,20 @@ class elfio
                       seg->add_section_index( psec->get_index(),
                                               psec->get_addr_align() );
                 }
+
+                // Segments are views of a section that covers their whole
+                // file image rather than a second copy of the same bytes
+                if ( seg->get_file_size() != 0 &&
+                     psec->get_type() != SHT_NOBITS &&
+                     psec->get_offset() == segBaseOffset &&
+                     psec->get_size() >= seg->get_file_size() ) {
+                    seg->set_data_section( psec );
+                }
+            }
+
+            // Anything else is read while the stream is still there
+            if ( !lazy_load ) {
+                seg->get_data();
             }
 
             // Add section into the segments' container
@@ -888,6 +943,10 @@ class elfio
     endianess_convertor   convertor;
 
     Elf_Xword current_file_pos;
+
+    bool                  lazy_load;
+    std::vector<Elf_Word> preload_types;
+    std::ifstream         lazy_file;
 };
 
 } // namespace ELFIO
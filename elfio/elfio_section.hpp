@@ -58,7 +58,8 @@ class section
     ELFIO_SET_ACCESS_DECL( Elf_Half,  index  );
     
     virtual void load( std::istream&  f,
-                       std::streampos header_offset ) = 0;
+                       std::streampos header_offset,
+                       bool           lazy )          = 0;
     virtual void save( std::ostream&  f,
                        std::streampos header_offset,
                        std::streampos data_offset )   = 0;
@@ -78,6 +79,7 @@ class section_impl : public section
         data           = 0;
         data_size      = 0;
         overlay        = 0;
+        lazy_stream    = 0;
     }
 
 //------------------------------------------------------------------------------
@@ -154,6 +156,9 @@ class section_impl : public section
     const char*
     get_data() const
     {
+        if ( 0 != lazy_stream ) {
+            load_data();
+        }
         return data;
     }
 
@@ -161,6 +166,7 @@ class section_impl : public section
     void
     set_data( const char* raw_data, Elf_Word size )
     {
+        lazy_stream = 0;
         if ( get_type() != SHT_NOBITS ) {
             delete [] data;
             try {
@@ -190,6 +196,9 @@ class section_impl : public section
     void
     append_data( const char* raw_data, Elf_Word size )
     {
+        if ( 0 != lazy_stream ) {
+            load_data();
+        }
         if ( get_type() != SHT_NOBITS ) {
             if ( get_size() + size < data_size ) {
                 std::copy( raw_data, raw_data + size, data + get_size() );
@@ -236,24 +245,21 @@ class section_impl : public section
 //------------------------------------------------------------------------------
     void
     load( std::istream&  stream,
-          std::streampos header_offset )
+          std::streampos header_offset,
+          bool           lazy )
     {
         std::fill_n( reinterpret_cast<char*>( &header ), sizeof( header ), '\0' );
         stream.seekg( header_offset );
         stream.read( reinterpret_cast<char*>( &header ), sizeof( header ) );
 
-        Elf_Xword size = get_size();
         if ( 0 == data && SHT_NULL != get_type() && SHT_NOBITS != get_type() ) {
-            try {
-                data = new char[size];
-            } catch (const std::bad_alloc&) {
-                data      = 0;
-                data_size = 0;
-            }
-            if ( 0 != size ) {
-                stream.seekg( (*convertor)( header.sh_offset ) );
-                stream.read( data, size );
-                data_size = size;
+            // A lazy section remembers where its data is and reads it on
+            // first access, the stream has to outlive it until then
+            lazy_stream = &stream;
+            lazy_offset = (*convertor)( header.sh_offset );
+            lazy_size   = get_size();
+            if ( !lazy ) {
+                load_data();
             }
         }
     }
@@ -278,6 +284,27 @@ class section_impl : public section
 
 //------------------------------------------------------------------------------
   private:
+//------------------------------------------------------------------------------
+    void
+    load_data() const
+    {
+        std::istream* stream = lazy_stream;
+        lazy_stream = 0;
+
+        try {
+            data = new char[lazy_size];
+        } catch (const std::bad_alloc&) {
+            data      = 0;
+            data_size = 0;
+        }
+        if ( 0 != data && 0 != lazy_size ) {
+            stream->clear();
+            stream->seekg( lazy_offset );
+            stream->read( data, lazy_size );
+            data_size = lazy_size;
+        }
+    }
+
 //------------------------------------------------------------------------------
     void
     save_header( std::ostream&  f,
@@ -301,8 +328,11 @@ class section_impl : public section
     T                          header;
     Elf_Half                   index;
     std::string                name;
-    char*                      data;
-    Elf_Word                   data_size;
+    mutable char*              data;
+    mutable Elf_Word           data_size;
+    mutable std::istream*      lazy_stream;
+    Elf64_Off                  lazy_offset;
+    Elf_Xword                  lazy_size;
     const endianess_convertor* convertor;
     bool                       is_address_set;
     Elf_Word                   overlay;
@@ -57,7 +57,9 @@ class segment
     ELFIO_SET_ACCESS_DECL( Elf_Half,  index  );
     
     virtual const std::vector<Elf_Half>& get_sections() const               = 0;
-    virtual void load( std::istream& stream, std::streampos header_offset ) = 0;
+    virtual void set_data_section( const section* sec )                     = 0;
+    virtual void load( std::istream& stream, std::streampos header_offset,
+                                             bool lazy )                    = 0;
     virtual void save( std::ostream& f,      std::streampos header_offset,
                                              std::streampos data_offset )   = 0;
 };
@@ -76,6 +78,8 @@ class segment_impl : public segment
         std::fill_n( reinterpret_cast<char*>( &ph ), sizeof( ph ), '\0' );
         data = 0;
         overlay = 0;
+        lazy_stream = 0;
+        data_section = 0;
     }
 
 //------------------------------------------------------------------------------
@@ -120,6 +124,15 @@ class segment_impl : public segment
     const char*
     get_data() const
     {
+        // A view of the section the segment was loaded from. It follows later
+        // set_data() calls on that section rather than keeping a snapshot, so
+        // once the section shrinks only its get_size() bytes are the segment's.
+        if ( 0 != data_section ) {
+            return data_section->get_data();
+        }
+        if ( 0 != lazy_stream ) {
+            load_data();
+        }
         return data;
     }
 
@@ -179,6 +192,16 @@ class segment_impl : public segment
     {
         return sections;
     }
+
+//------------------------------------------------------------------------------
+    void
+    set_data_section( const section* sec )
+    {
+        // The section has the same bytes, no need to ever read a copy. The
+        // stream may be gone after an eager load, so it can't be a fallback.
+        data_section = sec;
+        lazy_stream  = 0;
+    }
     
 //------------------------------------------------------------------------------
     void
@@ -190,22 +213,19 @@ class segment_impl : public segment
 //------------------------------------------------------------------------------
     void
     load( std::istream&  stream,
-          std::streampos header_offset )
+          std::streampos header_offset,
+          bool           lazy )
     {
         stream.seekg( header_offset );
         stream.read( reinterpret_cast<char*>( &ph ), sizeof( ph ) );
         is_offset_set = true;
 
         if ( PT_NULL != get_type() && 0 != get_file_size() ) {
-            stream.seekg( (*convertor)( ph.p_offset ) );
-            Elf_Xword size = get_file_size();
-            try {
-                data = new char[size];
-            } catch (const std::bad_alloc&) {
-                data = 0;
-            }
-            if ( 0 != data ) {
-                stream.read( data, size );
+            lazy_stream = &stream;
+            lazy_offset = (*convertor)( ph.p_offset );
+            lazy_size   = get_file_size();
+            if ( !lazy ) {
+                load_data();
             }
         }
     }
@@ -221,11 +241,36 @@ class segment_impl : public segment
         f.write( reinterpret_cast<const char*>( &ph ), sizeof( ph ) );
     }
 
+//------------------------------------------------------------------------------
+  private:
+//------------------------------------------------------------------------------
+    void
+    load_data() const
+    {
+        std::istream* stream = lazy_stream;
+        lazy_stream = 0;
+
+        try {
+            data = new char[lazy_size];
+        } catch (const std::bad_alloc&) {
+            data = 0;
+        }
+        if ( 0 != data ) {
+            stream->clear();
+            stream->seekg( lazy_offset );
+            stream->read( data, lazy_size );
+        }
+    }
+
 //------------------------------------------------------------------------------
   private:
     T                     ph;
     Elf_Half              index;
-    char*                 data;
+    mutable char*         data;
+    mutable std::istream* lazy_stream;
+    Elf64_Off             lazy_offset;
+    Elf_Xword             lazy_size;
+    const section*        data_section;
     std::vector<Elf_Half> sections;
     endianess_convertor*  convertor;
     bool                  is_offset_set;
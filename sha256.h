@@ -0,0 +1,257 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SHA256_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#elif defined(__ARM_FEATURE_SHA2) || defined(__ARM_FEATURE_CRYPTO)
+#define SHA256_ARMV8
+#include <arm_neon.h>
+#endif
+
+typedef struct
+{
+   uint32_t state[8];
+   uint64_t length;
+   uint8_t buffer[64];
+   size_t buffered;
+} SHA256_Context;
+
+typedef void (*sha256_compress_func)(uint32_t state[8], const uint8_t* data, size_t blocks);
+
+static const uint32_t sha256_k[64] =
+{
+   0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+   0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+   0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+   0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+   0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+   0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+   0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+   0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+inline uint32_t sha256_rotr(uint32_t x, int n)
+{
+   return (x >> n) | (x << (32 - n));
+}
+
+inline void sha256_compress_generic(uint32_t state[8], const uint8_t* data, size_t blocks)
+{
+   for (; blocks > 0; blocks--, data += 64)
+   {
+      uint32_t w[64];
+      for (int i = 0; i < 16; i++)
+         w[i] = (data[i*4] << 24) | (data[i*4+1] << 16) | (data[i*4+2] << 8) | data[i*4+3];
+
+      for (int i = 16; i < 64; i++)
+      {
+         uint32_t s0 = sha256_rotr(w[i-15], 7) ^ sha256_rotr(w[i-15], 18) ^ (w[i-15] >> 3);
+         uint32_t s1 = sha256_rotr(w[i-2], 17) ^ sha256_rotr(w[i-2], 19) ^ (w[i-2] >> 10);
+         w[i] = w[i-16] + s0 + w[i-7] + s1;
+      }
+
+      uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+      uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+      for (int i = 0; i < 64; i++)
+      {
+         uint32_t s1 = sha256_rotr(e, 6) ^ sha256_rotr(e, 11) ^ sha256_rotr(e, 25);
+         uint32_t t1 = h + s1 + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+         uint32_t s0 = sha256_rotr(a, 2) ^ sha256_rotr(a, 13) ^ sha256_rotr(a, 22);
+         uint32_t t2 = s0 + ((a & b) ^ (a & c) ^ (b & c));
+
+         h = g; g = f; f = e; e = d + t1;
+         d = c; c = b; b = a; a = t1 + t2;
+      }
+
+      state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+      state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+   }
+}
+
+#ifdef SHA256_X86
+// SHA-NI keeps the state as ABEF/CDGH halves and does two rounds per instruction
+__attribute__((target("sha,sse4.1,ssse3")))
+inline void sha256_compress_shani(uint32_t state[8], const uint8_t* data, size_t blocks)
+{
+   const __m128i byteswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+   __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[0]), 0xB1); // CDAB
+   __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[4]), 0x1B); // EFGH
+   __m128i state0 = _mm_alignr_epi8(tmp, state1, 8); // ABEF
+   state1 = _mm_blend_epi16(state1, tmp, 0xF0); // CDGH
+
+   for (; blocks > 0; blocks--, data += 64)
+   {
+      __m128i abef = state0, cdgh = state1;
+      __m128i msg[4];
+
+      for (int i = 0; i < 16; i++)
+      {
+         if (i < 4)
+            msg[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + i * 16)), byteswap);
+         else
+            msg[i & 3] = _mm_sha256msg2_epu32(_mm_add_epi32(_mm_sha256msg1_epu32(msg[i & 3], msg[(i + 1) & 3]),
+                                                            _mm_alignr_epi8(msg[(i + 3) & 3], msg[(i + 2) & 3], 4)),
+                                              msg[(i + 3) & 3]);
+
+         __m128i wk = _mm_add_epi32(msg[i & 3], _mm_loadu_si128((const __m128i*)&sha256_k[i * 4]));
+         state1 = _mm_sha256rnds2_epu32(state1, state0, wk);
+         state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(wk, 0x0E));
+      }
+
+      state0 = _mm_add_epi32(state0, abef);
+      state1 = _mm_add_epi32(state1, cdgh);
+   }
+
+   tmp = _mm_shuffle_epi32(state0, 0x1B); // FEBA
+   state1 = _mm_shuffle_epi32(state1, 0xB1); // DCHG
+   _mm_storeu_si128((__m128i*)&state[0], _mm_blend_epi16(tmp, state1, 0xF0)); // DCBA
+   _mm_storeu_si128((__m128i*)&state[4], _mm_alignr_epi8(state1, tmp, 8)); // HGFE
+}
+
+inline bool sha256_have_shani()
+{
+   unsigned int eax, ebx, ecx, edx;
+   if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_SSE4_1) || !(ecx & bit_SSSE3))
+      return false;
+   if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+      return false;
+
+   return (ebx & (1 << 29)) != 0;
+}
+#endif
+
+#ifdef SHA256_ARMV8
+inline void sha256_compress_armv8(uint32_t state[8], const uint8_t* data, size_t blocks)
+{
+   uint32x4_t state0 = vld1q_u32(&state[0]);
+   uint32x4_t state1 = vld1q_u32(&state[4]);
+
+   for (; blocks > 0; blocks--, data += 64)
+   {
+      uint32x4_t abcd = state0, efgh = state1;
+      uint32x4_t msg[4];
+
+      for (int i = 0; i < 4; i++)
+         msg[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + i * 16)));
+
+      for (int i = 0; i < 16; i++)
+      {
+         uint32x4_t wk = vaddq_u32(msg[i & 3], vld1q_u32(&sha256_k[i * 4]));
+         if (i < 12)
+            msg[i & 3] = vsha256su1q_u32(vsha256su0q_u32(msg[i & 3], msg[(i + 1) & 3]), msg[(i + 2) & 3], msg[(i + 3) & 3]);
+
+         uint32x4_t tmp = state0;
+         state0 = vsha256hq_u32(state0, state1, wk);
+         state1 = vsha256h2q_u32(state1, tmp, wk);
+      }
+
+      state0 = vaddq_u32(state0, abcd);
+      state1 = vaddq_u32(state1, efgh);
+   }
+
+   vst1q_u32(&state[0], state0);
+   vst1q_u32(&state[4], state1);
+}
+#endif
+
+// Picks the fastest kernel the CPU supports, once
+inline sha256_compress_func sha256_get_compress()
+{
+   static const sha256_compress_func compress =
+#if defined(SHA256_X86)
+      sha256_have_shani() ? sha256_compress_shani : sha256_compress_generic;
+#elif defined(SHA256_ARMV8)
+      sha256_compress_armv8;
+#else
+      sha256_compress_generic;
+#endif
+   return compress;
+}
+
+inline const char* sha256_backend()
+{
+#if defined(SHA256_X86)
+   if (sha256_get_compress() == sha256_compress_shani) return "sha-ni";
+#elif defined(SHA256_ARMV8)
+   return "armv8-crypto";
+#endif
+   return "generic";
+}
+
+inline void sha256_init(SHA256_Context& ctx)
+{
+   static const uint32_t initial_state[8] =
+   {
+      0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+   };
+
+   memcpy(ctx.state, initial_state, sizeof(initial_state));
+   ctx.length = 0;
+   ctx.buffered = 0;
+}
+
+inline void sha256_update(SHA256_Context& ctx, const void* data, size_t size)
+{
+   const uint8_t* bytes = (const uint8_t*)data;
+   sha256_compress_func compress = sha256_get_compress();
+   ctx.length += size;
+
+   if (ctx.buffered)
+   {
+      size_t fill = 64 - ctx.buffered < size ? 64 - ctx.buffered : size;
+      memcpy(ctx.buffer + ctx.buffered, bytes, fill);
+      ctx.buffered += fill;
+      bytes += fill;
+      size -= fill;
+
+      if (ctx.buffered < 64) return;
+      compress(ctx.state, ctx.buffer, 1);
+      ctx.buffered = 0;
+   }
+
+   // Whole blocks are hashed straight from the input
+   if (size >= 64)
+   {
+      compress(ctx.state, bytes, size / 64);
+      bytes += size & ~(size_t)63;
+      size &= 63;
+   }
+
+   memcpy(ctx.buffer, bytes, size);
+   ctx.buffered = size;
+}
+
+inline void sha256_final(SHA256_Context& ctx, uint8_t hash[32])
+{
+   uint64_t bit_length = ctx.length * 8;
+   uint8_t padding[72] = {0x80};
+   size_t padding_size = (ctx.buffered < 56 ? 56 : 120) - ctx.buffered;
+
+   for (int i = 0; i < 8; i++)
+      padding[padding_size + i] = bit_length >> (56 - i * 8);
+   sha256_update(ctx, padding, padding_size + 8);
+
+   for (int i = 0; i < 8; i++)
+   {
+      hash[i*4] = ctx.state[i] >> 24;
+      hash[i*4+1] = ctx.state[i] >> 16;
+      hash[i*4+2] = ctx.state[i] >> 8;
+      hash[i*4+3] = ctx.state[i];
+   }
+}
+
+inline void sha256(const void* data, size_t size, uint8_t hash[32])
+{
+   SHA256_Context ctx;
+   sha256_init(ctx);
+   sha256_update(ctx, data, size);
+   sha256_final(ctx, hash);
+}
+
+#endif // SHA256_H
@@ -0,0 +1,199 @@
+#ifndef TOOL_STATS_H
+#define TOOL_STATS_H
+
+#include <chrono>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+// Phase timers and counters shared by elf2cro, cro2elf and elfinject. Both
+// are always collected, they cost a clock read per phase and an add per
+// count. --stats dumps them as JSON once the tool is done.
+enum Tool_Counter
+{
+   STAT_SYMBOLS = 0,     // symbols decoded from .dynsym or CRO tables
+   STAT_RELOCS,          // relocations converted, rebased or written
+   STAT_BYTES_COPIED,    // segment, table and section bytes copied
+   STAT_ALLOCATIONS,     // buffers the tool itself allocates or grows
+   STAT_SECTION_LOOKUPS, // sections found by name or walked by type
+   STAT_SEGMENT_LOOKUPS, // address to segment searches
+   STAT_NUM_COUNTERS,
+};
+
+static const char* const tool_counter_names[STAT_NUM_COUNTERS] =
+{
+   "symbols",
+   "relocs",
+   "bytes_copied",
+   "allocations",
+   "section_lookups",
+   "segment_lookups",
+};
+
+typedef std::chrono::steady_clock tool_clock;
+
+typedef struct
+{
+   const char* name;
+   int depth;
+   double ms;
+} Tool_PhaseTime;
+
+typedef struct
+{
+   uint64_t counters[STAT_NUM_COUNTERS];
+   std::vector<Tool_PhaseTime> phases; // in the order they started
+   int depth;
+} Tool_Stats;
+
+inline Tool_Stats& tool_stats()
+{
+   static Tool_Stats stats = {};
+   return stats;
+}
+
+inline void tool_stats_count(Tool_Counter counter, uint64_t amount = 1)
+{
+   tool_stats().counters[counter] += amount;
+}
+
+// Index + 1 of the innermost running phase, 0 outside of any. Plain static
+// so allocation hooks can read it before and after main().
+inline int& tool_stats_current_phase()
+{
+   static int current = 0;
+   return current;
+}
+
+// Diagnostic builds add their own report at exit through this, see alloc_trace.h
+typedef void (*Tool_Stats_Hook)(FILE* out);
+
+inline Tool_Stats_Hook& tool_stats_report_hook()
+{
+   static Tool_Stats_Hook hook = NULL;
+   return hook;
+}
+
+// Times the enclosing scope, phases opened inside it are nested under it.
+// next() ends the phase and starts a sibling, for long flat functions.
+class Tool_Phase
+{
+public:
+   Tool_Phase(const char* name)
+   {
+      begin(name);
+      tool_stats().depth++;
+   }
+
+   ~Tool_Phase()
+   {
+      end();
+      tool_stats().depth--;
+   }
+
+   void next(const char* name)
+   {
+      end();
+      tool_stats().depth--;
+      begin(name);
+      tool_stats().depth++;
+   }
+
+private:
+   void begin(const char* name)
+   {
+      Tool_PhaseTime phase = {name, tool_stats().depth, 0};
+      parent = tool_stats_current_phase();
+      index = tool_stats().phases.size();
+      tool_stats().phases.push_back(phase);
+      tool_stats_current_phase() = index + 1;
+      start = tool_clock::now();
+   }
+
+   void end()
+   {
+      tool_stats().phases[index].ms = std::chrono::duration<double, std::milli>(tool_clock::now() - start).count();
+      tool_stats_current_phase() = parent;
+   }
+
+   size_t index;
+   int parent;
+   tool_clock::time_point start;
+};
+
+// Removes --stats and --stats=<file.json> from the arguments, so tools with
+// positional arguments can keep indexing argv. Returns the output path, "-"
+// for stderr, or NULL when stats weren't asked for.
+inline const char* tool_stats_parse_args(int& argc, char** argv)
+{
+   const char* path = NULL;
+   int out = 1;
+   for (int i = 1; i < argc; i++)
+   {
+      if (!strcmp(argv[i], "--stats"))
+         path = "-";
+      else if (!strncmp(argv[i], "--stats=", 8))
+         path = argv[i] + 8;
+      else
+         argv[out++] = argv[i];
+   }
+
+   argc = out;
+   argv[argc] = NULL;
+   return path;
+}
+
+inline void tool_stats_write_json(FILE* out, const char* tool, double total_ms)
+{
+   const Tool_Stats& stats = tool_stats();
+   fprintf(out, "{\n  \"tool\": \"%s\",\n  \"total_ms\": %.3f,\n  \"phases\": [", tool, total_ms);
+   for (size_t i = 0; i < stats.phases.size(); i++)
+   {
+      fprintf(out, "%s\n    {\"name\": \"%s\", \"depth\": %d, \"ms\": %.3f}", i ? "," : "",
+              stats.phases[i].name, stats.phases[i].depth, stats.phases[i].ms);
+   }
+   fprintf(out, "\n  ],\n  \"counters\": {");
+   for (int i = 0; i < STAT_NUM_COUNTERS; i++)
+      fprintf(out, "%s\n    \"%s\": %llu", i ? "," : "", tool_counter_names[i], (unsigned long long)stats.counters[i]);
+   fprintf(out, "\n  }\n}\n");
+}
+
+// Lives for the whole of main() and writes the report however main returns
+class Tool_Stats_Report
+{
+public:
+   Tool_Stats_Report(const char* tool, const char* path) : tool(tool), path(path), start(tool_clock::now()) {}
+
+   ~Tool_Stats_Report()
+   {
+      if (tool_stats_report_hook())
+         tool_stats_report_hook()(stderr);
+      if (!path) return;
+
+      double total_ms = std::chrono::duration<double, std::milli>(tool_clock::now() - start).count();
+      // stdout already carries the tool's own messages
+      if (!strcmp(path, "-"))
+      {
+         tool_stats_write_json(stderr, tool, total_ms);
+         return;
+      }
+
+      FILE* out = fopen(path, "w");
+      if (!out)
+      {
+         printf("Failed to open file %s for writing stats!\n", path);
+         return;
+      }
+      tool_stats_write_json(out, tool, total_ms);
+      fclose(out);
+   }
+
+private:
+   const char* tool;
+   const char* path;
+   tool_clock::time_point start;
+};
+
+#endif // TOOL_STATS_H